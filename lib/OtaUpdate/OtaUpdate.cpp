@@ -0,0 +1,321 @@
+#include "OtaUpdate.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// SHA-256 (FIPS 180-4). Plain C so the device and the native tests hash with
+// the same code; at ~1.4KB per chunk it is far from the bottleneck next to
+// WiFi and flash erase.
+static const uint32_t SHA_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void OtaSha256::begin() {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(h, init, sizeof(h));
+    total = 0;
+    used = 0;
+}
+
+void OtaSha256::block(const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + SHA_K[i] + w[i];
+        uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+void OtaSha256::update(const uint8_t *data, size_t len) {
+    total += len;
+    if (used) {
+        size_t n = 64 - used < len ? 64 - used : len;
+        memcpy(buf + used, data, n);
+        used += n;
+        data += n;
+        len -= n;
+        if (used < 64) return;
+        block(buf);
+        used = 0;
+    }
+    for (; len >= 64; data += 64, len -= 64) block(data);
+    memcpy(buf, data, len);
+    used = len;
+}
+
+void OtaSha256::finish(uint8_t (&digest)[32]) {
+    uint64_t bits = total * 8;
+    buf[used++] = 0x80;
+    if (used > 56) {
+        memset(buf + used, 0, 64 - used);
+        block(buf);
+        used = 0;
+    }
+    memset(buf + used, 0, 56 - used);
+    for (int i = 0; i < 8; i++) buf[56 + i] = bits >> (56 - i * 8);
+    block(buf);
+    for (int i = 0; i < 32; i++) digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = tolower((unsigned char)c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+bool OtaReceiver::begin(const char *shaHex, uint32_t size) {
+    this->size = size;
+    received = 0;
+    err = nullptr;
+    running = false;
+    if (!shaHex || strlen(shaHex) != 64) {
+        err = "missing or malformed sha256 parameter";
+        return false;
+    }
+    for (int i = 0; i < 32; i++) {
+        int hi = hexValue(shaHex[i * 2]), lo = hexValue(shaHex[i * 2 + 1]);
+        if (hi < 0 || lo < 0) {
+            err = "missing or malformed sha256 parameter";
+            return false;
+        }
+        expected[i] = hi << 4 | lo;
+    }
+    if (size == 0) {
+        err = "no firmware received";
+        return false;
+    }
+    if (!flash.begin(size)) {
+        err = "no OTA partition available for this size";
+        return false;
+    }
+    sha.begin();
+    running = true;
+    return true;
+}
+
+bool OtaReceiver::write(const uint8_t *data, size_t len) {
+    if (!running) return false;
+    if (len > size - received) {
+        abort("more data than Content-Length");
+        return false;
+    }
+    if (!flash.write(data, len)) {
+        abort("flash write failed");
+        return false;
+    }
+    sha.update(data, len);
+    received += len;
+    return true;
+}
+
+bool OtaReceiver::end() {
+    if (!running) return false;
+    if (received != size) {
+        abort("upload truncated");
+        return false;
+    }
+    uint8_t digest[32];
+    sha.finish(digest);
+    if (memcmp(digest, expected, sizeof(digest)) != 0) {
+        abort("sha256 mismatch");
+        return false;
+    }
+    running = false;
+    if (!flash.commit()) {
+        err = "image rejected when committing";
+        return false;
+    }
+    return true;
+}
+
+void OtaReceiver::abort(const char *why) {
+    err = why;
+    if (!running) return;
+    running = false;
+    flash.abort();
+}
+
+void OtaHttpUpload::start(OtaStream &stream, uint32_t now) {
+    this->stream = &stream;
+    headerLen = 0;
+    inBody = false;
+    done = false;
+    failed = false;
+    remaining = 0;
+    startedAt = now;
+    lastDataAt = now;
+    body[0] = 0;
+    peakHeapUsed = heapUsed ? heapUsed() : 0;
+}
+
+// header holds the request line and headers, NUL-terminated before the blank
+// line. Starts the receiver, or responds and returns false.
+bool OtaHttpUpload::parseHeader(uint32_t now) {
+    if (strncmp(header, "POST ", 5) != 0) {
+        respond(now, 405, "POST only");
+        return false;
+    }
+    const char *path = header + 5;
+    if (strncmp(path, "/update", 7) != 0 || (path[7] != '?' && path[7] != ' ')) {
+        respond(now, 404, "not found");
+        return false;
+    }
+
+    char sha[65] = "";
+    const char *lineEnd = strstr(header, "\r\n");
+    const char *param = strstr(path, "sha256=");
+    if (param && (!lineEnd || param < lineEnd)) {
+        param += 7;
+        size_t len = strcspn(param, "& \r");
+        if (len < sizeof(sha)) {
+            memcpy(sha, param, len);
+            sha[len] = 0;
+        }
+    }
+
+    long length = -1;
+    for (const char *line = lineEnd; line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) length = strtol(line + 17, nullptr, 10);
+    }
+    if (length < 0) {
+        respond(now, 411, "Content-Length required");
+        return false;
+    }
+
+    if (!receiver.begin(sha, length)) {
+        respond(now, 400, receiver.error());
+        return false;
+    }
+    remaining = length;
+    inBody = true;
+    return true;
+}
+
+bool OtaHttpUpload::service(uint32_t now) {
+    if (!stream) return false;
+    if (heapUsed) {
+        size_t used = heapUsed();
+        if (used > peakHeapUsed) peakHeapUsed = used;
+    }
+
+    uint8_t chunk[OTA_CHUNK];
+    const uint8_t *data = chunk;
+    int n;
+    if (!inBody) {
+        n = stream->read((uint8_t *)header + headerLen, sizeof(header) - 1 - headerLen);
+        if (n > 0) {
+            lastDataAt = now;
+            size_t scanFrom = headerLen > 3 ? headerLen - 3 : 0;
+            headerLen += n;
+            header[headerLen] = 0;
+            char *blank = strstr(header + scanFrom, "\r\n\r\n");
+            if (!blank) {
+                if (headerLen < sizeof(header) - 1) return true;
+                respond(now, 431, "request header too large");
+                return false;
+            }
+            *blank = 0;
+            if (!parseHeader(now)) return false;
+            // Whatever came in after the headers is the start of the body
+            data = (const uint8_t *)blank + 4;
+            n = headerLen - (blank + 4 - header);
+            if ((uint32_t)n > remaining) n = remaining;
+            if (n == 0) return true;
+        }
+    } else {
+        n = stream->read(chunk, remaining < OTA_CHUNK ? remaining : OTA_CHUNK);
+    }
+
+    if (n < 0) {
+        if (!inBody) {
+            respond(now, 400, "incomplete request");
+            return false;
+        }
+        receiver.abort("upload truncated");
+        respond(now, 400, receiver.error());
+        return false;
+    }
+    if (n == 0) {
+        if (now - lastDataAt <= OTA_IDLE_TIMEOUT) return true;
+        receiver.abort("upload timed out");
+        respond(now, 408, receiver.error());
+        return false;
+    }
+
+    lastDataAt = now;
+    if (!receiver.write(data, n)) {
+        respond(now, 500, receiver.error());
+        return false;
+    }
+    remaining -= n;
+    if (remaining) return true;
+    receiver.end();
+    respond(now, receiver.error() ? 400 : 200, receiver.error());
+    return false;
+}
+
+static const char *statusText(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 411: return "Length Required";
+    case 431: return "Request Header Fields Too Large";
+    default: return "Internal Server Error";
+    }
+}
+
+void OtaHttpUpload::respond(uint32_t now, int status, const char *error) {
+    uint32_t ms = now - startedAt;
+    uint32_t bytes = inBody ? receiver.bytes() : 0;
+    snprintf(body, sizeof(body),
+        "{\"ok\":%d,\"error\":\"%s\",\"bytes\":%lu,\"ms\":%lu,\"kbps\":%.1f,\"peak_heap_used\":%lu}",
+        error ? 0 : 1, error ? error : "", (unsigned long)bytes, (unsigned long)ms,
+        ms ? bytes * 8.0 / ms : 0.0, (unsigned long)peakHeapUsed);
+    char head[128];
+    int len = snprintf(head, sizeof(head),
+        "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+        status, statusText(status), (unsigned)strlen(body));
+    stream->write(head, len);
+    stream->write(body, strlen(body));
+    stream->close();
+    stream = nullptr;
+    done = true;
+    failed = error != nullptr;
+}
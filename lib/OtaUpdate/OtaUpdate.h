@@ -0,0 +1,113 @@
+#pragma once
+
+// OTA firmware upload: a minimal HTTP/1.1 request parser for
+// POST /update?sha256=<hex>, SHA-256 over the received bytes, and the
+// verify/commit decision. Flash goes through OtaFlashSink and the
+// connection through OtaStream, and service() handles at most one chunk per
+// call, so the caller's loop (sensors, strip, the web server) keeps running
+// between chunks and during stalls. The native tests drive the same code
+// over a lossy loopback proxy with an in-memory flash.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTA_CHUNK 1436            // max body bytes per service() call, one TCP segment
+#define OTA_MAX_HEADER 512        // request line + headers
+#define OTA_IDLE_TIMEOUT 10000    // ms without data before the upload is given up
+
+// Where the image goes. begin() gets the Content-Length.
+class OtaFlashSink {
+public:
+    virtual ~OtaFlashSink() {}
+    virtual bool begin(uint32_t size) = 0;
+    virtual bool write(const uint8_t *data, size_t len) = 0;
+    // Digest matched: finish the image and make it the boot image.
+    virtual bool commit() = 0;
+    virtual void abort() = 0;
+};
+
+// The client connection. Non-blocking: read() returns the bytes copied, 0 if
+// none are queued yet, or -1 once the client has closed and nothing is left.
+class OtaStream {
+public:
+    virtual ~OtaStream() {}
+    virtual int read(uint8_t *buf, size_t size) = 0;
+    virtual void write(const char *data, size_t len) = 0;
+    virtual void close() = 0;
+};
+
+class OtaSha256 {
+public:
+    void begin();
+    void update(const uint8_t *data, size_t len);
+    void finish(uint8_t (&digest)[32]);
+
+private:
+    void block(const uint8_t *p);
+
+    uint32_t h[8];
+    uint8_t buf[64];
+    uint64_t total;
+    size_t used;
+};
+
+// Image bytes in, verified commit or abort out. Errors are static strings.
+class OtaReceiver {
+public:
+    explicit OtaReceiver(OtaFlashSink &flash) : flash(flash) {}
+
+    // shaHex is the expected digest, 64 hex digits in either case.
+    bool begin(const char *shaHex, uint32_t size);
+    bool write(const uint8_t *data, size_t len);
+    // All bytes are in: commits if the size and digest match, aborts otherwise.
+    bool end();
+    void abort(const char *why);
+
+    bool active() const { return running; }
+    const char *error() const { return err; }
+    uint32_t bytes() const { return received; }
+
+private:
+    OtaFlashSink &flash;
+    OtaSha256 sha;
+    uint8_t expected[32] = {};
+    uint32_t size = 0;
+    uint32_t received = 0;
+    const char *err = nullptr;
+    bool running = false;
+};
+
+// One upload request, from the first header byte to the JSON response.
+class OtaHttpUpload {
+public:
+    explicit OtaHttpUpload(OtaFlashSink &flash) : receiver(flash) {}
+
+    void start(OtaStream &stream, uint32_t now);
+    // Reads at most OTA_CHUNK bytes and acts on them. Returns false once the
+    // response has been sent and the stream closed.
+    bool service(uint32_t now);
+
+    bool busy() const { return stream != nullptr; }
+    bool succeeded() const { return !stream && done && !failed; }
+    // JSON body of the last response: ok, error, bytes, ms, kbps, peak_heap_used
+    const char *response() const { return body; }
+
+    OtaReceiver receiver;
+    size_t peakHeapUsed = 0;              // over the last upload, from heapUsed
+    size_t (*heapUsed)() = nullptr;       // optional, bytes of heap in use
+
+private:
+    bool parseHeader(uint32_t now);
+    void respond(uint32_t now, int status, const char *error);
+
+    OtaStream *stream = nullptr;
+    char header[OTA_MAX_HEADER];
+    size_t headerLen = 0;
+    bool inBody = false;
+    bool done = false;
+    bool failed = false;
+    uint32_t remaining = 0;
+    uint32_t startedAt = 0;
+    uint32_t lastDataAt = 0;
+    char body[192] = "";
+};
@@ -0,0 +1,123 @@
+#include "RoomHub.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool roomStateChanged(const RoomPacket &a, const RoomPacket &b) {
+    return a.flags != b.flags || a.co2error != b.co2error
+        || abs(a.co2ppm - b.co2ppm) >= 10
+        || abs(a.temp10 - b.temp10) >= 2
+        || abs(a.humidity10 - b.humidity10) >= 10
+        || abs(a.batteryMv - b.batteryMv) >= 50;
+}
+
+void roomSanitizeName(char (&name)[ROOM_NAME_LEN]) {
+    for (size_t i = 0; i < ROOM_NAME_LEN && name[i]; i++) {
+        uint8_t c = name[i];
+        if (c < 0x20 || c >= 0x7F || c == '"' || c == '\\') name[i] = '_';
+    }
+}
+
+void RoomNode::begin(uint32_t nodeId, const char *name, bool candidate) {
+    this->candidate = candidate;
+    selfState = RoomPacket();
+    selfState.magic[0] = 'R';
+    selfState.magic[1] = 'C';
+    selfState.version = ROOM_PACKET_VERSION;
+    selfState.nodeId = nodeId;
+    strncpy(selfState.name, name, sizeof(selfState.name));
+    roomSanitizeName(selfState.name);
+    lastSent = selfState;
+    sentAny = false;
+    for (RoomEntry &r : rooms) r.used = false;
+}
+
+void RoomNode::update(const RoomPacket &p, uint32_t ip, uint32_t now) {
+    int slot = -1;
+    for (int i = 0; i < ROOM_MAX; i++) {
+        if (rooms[i].used && rooms[i].state.nodeId == p.nodeId) { slot = i; break; }
+        if (!rooms[i].used && slot < 0) slot = i;
+    }
+    if (slot < 0) return;  // table full
+    RoomEntry &r = rooms[slot];
+    bool joined = !r.used;
+    if (joined) {
+        r = RoomEntry();
+        r.used = true;
+    }
+    r.state = p;
+    roomSanitizeName(r.state.name);
+    r.ip = ip;
+    r.lastSeen = now;
+    if (joined && onJoin) onJoin(r);
+}
+
+void RoomNode::service(uint32_t now, const RoomPacket &cur, uint32_t selfIp) {
+    // Receive everything queued
+    RoomPacket p;
+    uint32_t from;
+    while (int len = socket.receive((uint8_t *)&p, sizeof(p), from)) {
+        if (len != sizeof(p)) continue;
+        if (p.magic[0] != 'R' || p.magic[1] != 'C' || p.version != ROOM_PACKET_VERSION) continue;
+        if (p.nodeId == selfState.nodeId) continue;  // our own packet looped back
+        update(p, from, now);
+    }
+
+    // Send on change or heartbeat
+    RoomPacket out = cur;
+    memcpy(out.magic, selfState.magic, sizeof(out.magic));
+    out.version = selfState.version;
+    out.nodeId = selfState.nodeId;
+    memcpy(out.name, selfState.name, sizeof(out.name));
+    out.flags = (out.flags & ~ROOM_FLAG_CANDIDATE) | (candidate ? ROOM_FLAG_CANDIDATE : 0);
+    uint32_t heartbeat = candidate ? ROOM_HUB_HEARTBEAT : ROOM_HEARTBEAT;
+    uint32_t sinceSent = now - lastSentAt;
+    if (!sentAny || sinceSent >= heartbeat
+        || (sinceSent >= ROOM_MIN_INTERVAL && roomStateChanged(out, lastSent))) {
+        out.seq = lastSent.seq + 1;
+        socket.send((const uint8_t *)&out, sizeof(out));
+        lastSent = out;
+        lastSentAt = now;
+        sentAny = true;
+    } else {
+        out.seq = lastSent.seq;
+    }
+    update(out, selfIp, now);
+
+    // Expire silent rooms
+    for (RoomEntry &r : rooms) {
+        if (r.used && now - r.lastSeen > ROOM_TIMEOUT) {
+            r.used = false;
+            if (onExpire) onExpire(r);
+        }
+    }
+
+    // History sample per room, skipping rooms with nothing read yet. A room
+    // with only one sensor read still gets a sample; its flags say which half
+    // holds readings.
+    if (now - lastHistory >= ROOM_HISTORY_INTERVAL) {
+        lastHistory = now;
+        for (RoomEntry &r : rooms) {
+            uint8_t valid = r.state.flags & (ROOM_FLAG_CO2_VALID | ROOM_FLAG_HTU_VALID);
+            if (!r.used || !valid) continue;
+            r.history[r.historyHead] = {r.state.co2ppm, r.state.temp10, r.state.humidity10, valid};
+            r.historyHead = (r.historyHead + 1) % ROOM_HISTORY_LEN;
+            if (r.historyCount < ROOM_HISTORY_LEN) r.historyCount++;
+        }
+    }
+}
+
+const RoomEntry *RoomNode::hub(uint32_t now) const {
+    const RoomEntry *hub = nullptr;
+    for (const RoomEntry &r : rooms) {
+        if (!r.used || !(r.state.flags & ROOM_FLAG_CANDIDATE)) continue;
+        if (now - r.lastSeen > ROOM_HUB_TIMEOUT) continue;
+        if (!hub || r.state.nodeId < hub->state.nodeId) hub = &r;
+    }
+    return hub;
+}
+
+bool RoomNode::isHub(uint32_t now) const {
+    const RoomEntry *h = hub(now);
+    return h && h->state.nodeId == selfState.nodeId;
+}
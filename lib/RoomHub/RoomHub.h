@@ -0,0 +1,113 @@
+#pragma once
+
+// Multi-room hub protocol: the state packet, the table of rooms heard, hub
+// election and expiry. It only talks to the network through RoomSocket and
+// takes the time as an argument, so the same code runs on the controller
+// (WiFiUDP, millis()) and in the native tests (POSIX sockets, a fake clock).
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROOM_MAX 8
+#define ROOM_HEARTBEAT 30000      // ms between packets when nothing changes
+#define ROOM_HUB_HEARTBEAT 10000  // same, for hub candidates
+#define ROOM_HUB_TIMEOUT 25000    // ms without a packet before a candidate can't be hub
+#define ROOM_MIN_INTERVAL 1000    // ms between change-triggered packets
+#define ROOM_TIMEOUT 90000        // ms without a packet before a room is dropped
+#define ROOM_HISTORY_INTERVAL 60000
+#define ROOM_HISTORY_LEN 60       // one hour at ROOM_HISTORY_INTERVAL
+#define ROOM_NAME_LEN 16
+#define ROOM_PACKET_VERSION 2
+#define ROOM_FLAG_CANDIDATE 0x01
+#define ROOM_FLAG_LED 0x02
+#define ROOM_FLAG_RELAY 0x04
+#define ROOM_FLAG_STRIP 0x08
+#define ROOM_FLAG_CO2_VALID 0x10  // co2ppm holds a reading (not the 0 placeholder)
+#define ROOM_FLAG_HTU_VALID 0x20  // same for temp10 / humidity10
+#define ROOM_FLAG_CO2_STALE 0x40  // co2ppm was restored from before a reset, not read since
+#define ROOM_FLAG_HTU_STALE 0x80
+
+struct __attribute__((packed)) RoomPacket {
+    char magic[2];          // "RC"
+    uint8_t version;
+    uint8_t flags;          // ROOM_FLAG_*
+    uint32_t nodeId;        // low 32 bits of the MAC
+    char name[ROOM_NAME_LEN];  // not NUL-terminated when full
+    uint16_t seq;
+    int16_t co2ppm;
+    uint8_t co2error;
+    int16_t temp10;         // 0.1 C
+    uint16_t humidity10;    // 0.1 %RH
+    uint16_t batteryMv;
+};
+
+struct RoomSample {
+    int16_t co2ppm;
+    int16_t temp10;
+    uint16_t humidity10;
+    uint8_t flags;          // ROOM_FLAG_CO2_VALID / ROOM_FLAG_HTU_VALID when sampled
+};
+
+struct RoomEntry {
+    bool used;
+    RoomPacket state;
+    uint32_t ip;             // as IPAddress stores it
+    uint32_t lastSeen;       // ms, the clock passed to RoomNode::service()
+    RoomSample history[ROOM_HISTORY_LEN];
+    uint8_t historyHead;
+    uint8_t historyCount;
+};
+
+// Datagram transport bound to the room multicast group.
+class RoomSocket {
+public:
+    virtual ~RoomSocket() {}
+    // Copies the next queued datagram into buf (at most size bytes) and
+    // returns its full length, or 0 if nothing is queued.
+    virtual int receive(uint8_t *buf, size_t size, uint32_t &fromIp) = 0;
+    // Sends one datagram to the group.
+    virtual bool send(const uint8_t *buf, size_t len) = 0;
+};
+
+// Worth a packet: actuator, validity or error change, or a reading moved past noise.
+bool roomStateChanged(const RoomPacket &a, const RoomPacket &b);
+
+// Replaces anything that can't go into a JSON string or the OLED unescaped
+// (quotes, backslashes, control and non-ASCII bytes) with '_'.
+void roomSanitizeName(char (&name)[ROOM_NAME_LEN]);
+
+class RoomNode {
+public:
+    explicit RoomNode(RoomSocket &socket) : socket(socket) {}
+
+    void begin(uint32_t nodeId, const char *name, bool candidate);
+
+    // Receives queued packets, sends ours on change or heartbeat, expires
+    // silent rooms and takes history samples. cur carries flags and readings;
+    // the header fields are filled in here.
+    void service(uint32_t now, const RoomPacket &cur, uint32_t selfIp);
+
+    // Lowest node ID among candidates heard within ROOM_HUB_TIMEOUT, or
+    // nullptr if there is none.
+    const RoomEntry *hub(uint32_t now) const;
+    bool isHub(uint32_t now) const;
+
+    const RoomPacket &self() const { return selfState; }
+
+    RoomEntry rooms[ROOM_MAX] = {};
+
+    // Optional log hooks
+    void (*onJoin)(const RoomEntry &room) = nullptr;
+    void (*onExpire)(const RoomEntry &room) = nullptr;
+
+private:
+    void update(const RoomPacket &p, uint32_t ip, uint32_t now);
+
+    RoomSocket &socket;
+    RoomPacket selfState = {};
+    RoomPacket lastSent = {};
+    uint32_t lastSentAt = 0;
+    uint32_t lastHistory = 0;
+    bool candidate = false;
+    bool sentAny = false;
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+// LED strip colour pipeline. Everything that needs floating point is a
+// constexpr LUT built at compile time; per frame it is integer maths only:
+//   1. colour channel -> linear light via a gamma 2.2 LUT (8.8 fixed point)
+//   2. x LED correction x colour temperature preset (per-channel constant)
+//   3. x perceptual brightness: the slider is CIE 1931 lightness L*, so equal
+//      slider steps look like equal brightness steps
+// The result is 8.8 fixed point. The fractional part is carried from frame
+// to frame per channel (temporal dithering), so a level between two 8-bit
+// steps averages out instead of stepping. Only levels below
+// STRIP_DITHER_BELOW need extra frames for that: above it one 8-bit step is
+// too small a change in brightness to see, so the strip isn't refreshed just
+// to dither them.
+//
+// Header-only and free of Arduino/FastLED includes so the native tests can
+// check it against the floating point reference.
+
+#include <array>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STRIP_GAMMA 2.2
+#define STRIP_DITHER_BELOW 8      // keep refreshing while a fractional channel is below this level
+
+constexpr double cexpLn(double x) {
+    // x = m * 2^k with m in [0.5, 1), ln(m) = 2 atanh((m - 1) / (m + 1))
+    int k = 0;
+    while (x >= 1.0) { x /= 2; k++; }
+    while (x < 0.5) { x *= 2; k--; }
+    double z = (x - 1) / (x + 1), z2 = z * z, term = z, sum = 0;
+    for (int n = 1; n < 40; n += 2) {
+        sum += term / n;
+        term *= z2;
+    }
+    return 2 * sum + k * 0.69314718055994530942;
+}
+
+constexpr double cexpExp(double x) {
+    // exp(x) = exp(x / 2^k)^(2^k), Taylor series for |x| <= 0.5
+    int k = 0;
+    while (x > 0.5 || x < -0.5) { x /= 2; k++; }
+    double term = 1, sum = 1;
+    for (int n = 1; n < 20; n++) {
+        term *= x / n;
+        sum += term;
+    }
+    while (k-- > 0) sum *= sum;
+    return sum;
+}
+
+constexpr double cexpPow(double base, double e) {
+    return base <= 0 ? 0 : cexpExp(e * cexpLn(base));
+}
+
+constexpr std::array<uint16_t, 256> makeGammaLut() {
+    std::array<uint16_t, 256> lut{};
+    for (int i = 0; i < 256; i++) {
+        lut[i] = (uint16_t)(cexpPow(i / 255.0, STRIP_GAMMA) * (255 << 8) + 0.5);
+    }
+    return lut;
+}
+
+constexpr std::array<uint16_t, 256> makeBrightnessLut() {
+    // CIE 1931: lightness L* (0-100) -> relative luminance Y
+    std::array<uint16_t, 256> lut{};
+    for (int i = 0; i < 256; i++) {
+        double l = i * 100.0 / 255;
+        double f = (l + 16) / 116;
+        double y = l <= 8 ? l / 903.3 : f * f * f;
+        lut[i] = (uint16_t)(y * 65535 + 0.5);
+    }
+    return lut;
+}
+
+constexpr auto GAMMA_LUT = makeGammaLut();
+constexpr auto BRIGHTNESS_LUT = makeBrightnessLut();
+
+constexpr bool lutIsMonotonic(const std::array<uint16_t, 256> &lut) {
+    for (int i = 1; i < 256; i++) {
+        if (lut[i] < lut[i - 1]) return false;
+    }
+    return true;
+}
+
+static_assert(GAMMA_LUT[0] == 0 && GAMMA_LUT[255] == (255 << 8), "gamma LUT endpoints");
+static_assert(GAMMA_LUT[128] == 14330, "gamma LUT midpoint, (128/255)^2.2");
+static_assert(BRIGHTNESS_LUT[0] == 0 && BRIGHTNESS_LUT[255] == 65535, "brightness LUT endpoints");
+static_assert(BRIGHTNESS_LUT[128] == 12179, "brightness LUT midpoint, L* = 50.2");
+static_assert(lutIsMonotonic(GAMMA_LUT) && lutIsMonotonic(BRIGHTNESS_LUT), "LUTs must be monotonic");
+
+struct ColorTempPreset {
+    const char *name;
+    uint8_t r, g, b;
+};
+
+// Values from FastLED's color.h
+constexpr ColorTempPreset COLOR_TEMPS[] = {
+    {"neutral", 255, 255, 255},
+    {"candle", 255, 147, 41},      // 1900K
+    {"tungsten", 255, 214, 170},   // 2850K, 100W
+    {"halogen", 255, 241, 224},    // 3200K
+    {"overcast", 201, 226, 255},   // 7000K
+    {"clearsky", 64, 156, 255},    // 20000K
+};
+constexpr int NUM_COLOR_TEMPS = sizeof(COLOR_TEMPS) / sizeof(COLOR_TEMPS[0]);
+constexpr uint8_t LED_CORRECTION[3] = {255, 176, 240};  // FastLED TypicalLEDStrip
+
+constexpr uint16_t channelScale(int preset, int ch) {
+    const uint8_t temp[3] = {COLOR_TEMPS[preset].r, COLOR_TEMPS[preset].g, COLOR_TEMPS[preset].b};
+    return (uint16_t)((uint32_t)LED_CORRECTION[ch] * temp[ch] * 65535 / (255 * 255));
+}
+
+constexpr std::array<std::array<uint16_t, 3>, NUM_COLOR_TEMPS> makeChannelScales() {
+    std::array<std::array<uint16_t, 3>, NUM_COLOR_TEMPS> scales{};
+    for (int p = 0; p < NUM_COLOR_TEMPS; p++) {
+        for (int ch = 0; ch < 3; ch++) scales[p][ch] = channelScale(p, ch);
+    }
+    return scales;
+}
+
+constexpr auto CHANNEL_SCALES = makeChannelScales();
+
+// Per-channel multipliers (0.16 fixed point) for a preset and slider position.
+inline void stripMultipliers(int preset, uint8_t brightness, uint32_t (&mult)[3]) {
+    for (int ch = 0; ch < 3; ch++) {
+        mult[ch] = (uint32_t)CHANNEL_SCALES[preset][ch] * BRIGHTNESS_LUT[brightness] >> 16;
+    }
+}
+
+// Starts each pixel's dither carry at a different point (golden ratio steps
+// of 1/256), so a solid colour dithers as a shimmer across the strip rather
+// than every pixel stepping up on the same frame.
+template <size_t N>
+void stripSeedResidue(uint8_t (&residue)[N][3]) {
+    for (size_t i = 0; i < N; i++) {
+        for (int ch = 0; ch < 3; ch++) residue[i][ch] = (uint8_t)(i * 158 + ch * 85);
+    }
+}
+
+// Runs src through the pipeline into dst. N is the strip length, so the
+// pixel loop has a compile-time trip count; Pixel is anything indexable by
+// channel (CRGB on the device). Returns true if any channel sits between two
+// low levels and needs more frames to dither.
+template <typename Pixel, size_t N>
+bool renderStrip(const Pixel (&src)[N], Pixel (&dst)[N], const uint32_t (&mult)[3], uint8_t (&residue)[N][3]) {
+    bool dither = false;
+    for (size_t i = 0; i < N; i++) {
+        for (int ch = 0; ch < 3; ch++) {
+            uint32_t level = (uint32_t)GAMMA_LUT[src[i][ch]] * mult[ch] >> 16;  // 8.8
+            if ((level & 0xFF) && (level >> 8) < STRIP_DITHER_BELOW) dither = true;
+            level += residue[i][ch];
+            residue[i][ch] = level & 0xFF;
+            dst[i][ch] = level >> 8;  // max 0xFEFF + 0xFF, no overflow
+        }
+    }
+    return dither;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# ota.sh — Push firmware to a running controller over WiFi
+#
+# Builds (unless a .bin is given), computes the image SHA-256 and POSTs the
+# raw image to the OTA listener on port 8080.  The device verifies the hash
+# before switching partitions, reboots into the new image, and rolls back if
+# it doesn't come up healthy.  Prints the device's JSON result (bytes, ms,
+# kbps, peak_heap_used) and the throughput seen by curl.
+#
+# Usage:
+#   ./ota.sh <ip> [firmware.bin]
+#
+#   RATE=20k   throttle the upload with curl --limit-rate
+#
+# Uploads over a lossy link are covered by the native test (test/test_ota).
+
+IP="$1"
+BIN="${2:-.pio/build/esp32-c3-devkitm-1/firmware.bin}"
+
+if [ -z "$IP" ]; then
+    echo "Usage: $0 <ip> [firmware.bin]"
+    exit 1
+fi
+
+if [ -z "$2" ]; then
+    pio run || exit 1
+fi
+
+if [ ! -f "$BIN" ]; then
+    echo "No firmware image at $BIN"
+    exit 1
+fi
+
+SHA=$(sha256sum "$BIN" | cut -d' ' -f1)
+echo "Uploading $BIN ($(stat -c%s "$BIN") bytes, sha256 $SHA)"
+
+curl --fail-with-body -sS ${RATE:+--limit-rate "$RATE"} \
+    -w '\ncurl: %{size_upload} bytes in %{time_total}s (%{speed_upload} B/s)\n' \
+    -H 'Content-Type: application/octet-stream' --data-binary "@$BIN" \
+    "http://$IP:8080/update?sha256=$SHA"
@@ -1,6 +1,7 @@
 #include <Arduino.h>
 #include <U8g2lib.h>
 #include <WiFi.h>
+#include <WiFiUdp.h>
 #define HTTP_MAX_DATA_WAIT  500   // ms to wait for client request (default 5000)
 #define HTTP_MAX_CLOSE_WAIT 500   // ms to wait for client close (default 2000)
 #include <WebServer.h>
@@ -9,7 +10,15 @@
 #include <Wire.h>
 #include <HTU21D.h>
 #include <FastLED.h>
+#include <Preferences.h>
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include <esp_attr.h>
+#include <esp_system.h>
 #include <sys/time.h>
+#include <OtaUpdate.h>
+#include <RoomHub.h>
+#include <StripPipeline.h>
 #include "secrets.h"
 
 #define LED_PIN 8
@@ -22,6 +31,8 @@
 #define RELAY_PIN 7
 #define LED_STRIP_PIN 10
 #define NUM_LEDS 30
+#define STRIP_MIN_BRIGHTNESS 2    // bottom of the web UI slider
+#define STRIP_DEFAULT_BRIGHTNESS 128
 
 U8G2_SSD1306_72X40_ER_F_HW_I2C u8g2(U8G2_R0, U8X8_PIN_NONE, 6, 5);
 WebServer server(80);
@@ -43,8 +54,9 @@ int co2error = 0;
 unsigned long lastCO2Read = 0;
 float htuTemp = 0.0;
 float htuHumidity = 0.0;
-uint8_t stripBrightness = 128;
+uint8_t stripBrightness = STRIP_DEFAULT_BRIGHTNESS;
 CRGB stripColor = CRGB::White;
+uint8_t stripColorTemp = 0;  // index into COLOR_TEMPS
 bool stripOn = false;
 String stripMode = "solid";
 uint8_t rainbowHue = 0;
@@ -68,12 +80,436 @@ void dbgClient(const char* tag) {
     }
 }
 
+// Span tracer: fixed-size events in a RAM ring, dumped by /trace as Chrome
+// trace_event JSON (open in https://ui.perfetto.dev). Names must be string
+// literals -- only the pointer is stored.
+#define TRACE_BUFFER_SIZE 1024    // events (16 bytes each), must be a power of 2
+#define TRACE_DEFAULT_SECONDS 10  // /trace window when no s= param is given
+#define TRACE_MAX_SECONDS 600
+
+struct TraceEvent {
+    const char* name;
+    uint32_t start;  // micros()
+    uint32_t dur;    // microseconds, 0 for instant events
+    char ph;         // 'X' = complete span, 'i' = instant
+};
+
+static_assert((TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1)) == 0, "TRACE_BUFFER_SIZE must be a power of 2");
+
+TraceEvent traceBuf[TRACE_BUFFER_SIZE];
+uint16_t traceHead = 0;   // next slot to write
+uint16_t traceCount = 0;  // valid events in the ring
+bool traceEnabled = true;
+uint32_t traceOverheadNs = 0;
+
+inline void traceRecord(const char* name, uint32_t start, uint32_t dur, char ph) {
+    if (!traceEnabled) return;
+    TraceEvent &e = traceBuf[traceHead];
+    e.name = name;
+    e.start = start;
+    e.dur = dur;
+    e.ph = ph;
+    traceHead = (traceHead + 1) & (TRACE_BUFFER_SIZE - 1);
+    if (traceCount < TRACE_BUFFER_SIZE) traceCount++;
+}
+
+inline void traceInstant(const char* name) {
+    traceRecord(name, micros(), 0, 'i');
+}
+
+// Records a span from construction to end of scope. Spans shorter than minUs
+// are dropped, so idle loop iterations don't flush the ring.
+struct TraceSpan {
+    const char* name;
+    uint32_t start;
+    uint32_t minUs;
+    TraceSpan(const char* n, uint32_t min = 0) : name(n), start(micros()), minUs(min) {}
+    ~TraceSpan() {
+        uint32_t dur = micros() - start;
+        if (dur >= minUs) traceRecord(name, start, dur, 'X');
+    }
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan_, __LINE__)(name)
+#define TRACE_SPAN_MIN(name, minUs) TraceSpan TRACE_CONCAT(traceSpan_, __LINE__)(name, minUs)
+
+// Time a batch of empty spans, then reset the ring. Reported in /trace.
+void measureTraceOverhead() {
+    const uint32_t n = 1000;
+    uint32_t t0 = micros();
+    for (uint32_t i = 0; i < n; i++) {
+        TRACE_SPAN("overhead");
+    }
+    traceOverheadNs = (micros() - t0) * 1000 / n;
+    traceHead = 0;
+    traceCount = 0;
+    Serial.printf("Trace: %lu ns per span\n", (unsigned long)traceOverheadNs);
+}
+
+bool otaActive = false;  // firmware upload in progress, see otaService()
+
+void serviceClient() {
+    TRACE_SPAN_MIN("handleClient", 1500);  // idle calls are a bare delay(1)
+    server.handleClient();
+}
+
 enum CO2State { CO2_IDLE, CO2_WAITING };
 CO2State co2State = CO2_IDLE;
 unsigned long co2CmdSent = 0;
 const byte CO2_CMD[9] = {0xFF, 0x01, 0x86, 0x00, 0x00, 0x00, 0x00, 0x00, 0x79};
 
+// Warm restart. Actuator state goes to NVS, coalesced: handlers only mark it
+// dirty and loop() writes once nothing has changed for STATE_SAVE_DELAY ms, so
+// dragging the brightness slider costs one flash write, not one per tick.
+// The last sensor readings live in RTC memory (RTC_NOINIT_ATTR), which
+// survives soft resets, watchdog resets and brownouts but not power-on.
+#define STATE_SAVE_DELAY 3000      // ms of no changes before writing to NVS
+#define SNAPSHOT_MAGIC 0x524F4F4D  // "ROOM"
+
+struct ActuatorState {
+    uint8_t led;
+    uint8_t relay;
+    uint8_t stripOn;
+    uint8_t brightness;
+    uint8_t r, g, b;
+    uint8_t rainbow;  // 1 = rainbow, 0 = solid
+    uint8_t colorTemp;
+};
+
+struct ReadingSnapshot {
+    uint32_t magic;
+    int32_t co2ppm;
+    int32_t co2temp;
+    int32_t co2error;
+    float htuTemp;
+    float htuHumidity;
+    uint64_t co2At;           // epochMs() of the reading, 0 = never
+    uint64_t htuAt;
+    uint32_t sensorUptimeMs;  // CO2 sensor on-time; it stays powered across ESP resets
+    uint32_t checksum;
+};
+
+enum { SNAP_CO2 = 1, SNAP_HTU = 2 };
+
+Preferences prefs;
+ActuatorState savedState;
+bool stateDirty = false;
+unsigned long stateChangedAt = 0;
+uint32_t nvsWrites = 0;
+RTC_NOINIT_ATTR ReadingSnapshot rtcSnapshot;
+uint8_t staleReadings = 0;       // SNAP_* bits for readings restored from before the reset
+uint8_t validReadings = 0;       // SNAP_* bits for readings we have a value for, fresh or restored
+uint32_t co2SensorBaseMs = 0;    // sensor on-time carried over from before the reset
+bool warmBoot = false;
+esp_reset_reason_t resetReason;
+unsigned long bootRestoreMs = 0;
+
+ActuatorState currentState() {
+    ActuatorState st;
+    st.led = ledOn;
+    st.relay = relayOn;
+    st.stripOn = stripOn;
+    st.brightness = stripBrightness;
+    st.r = stripColor.r;
+    st.g = stripColor.g;
+    st.b = stripColor.b;
+    st.rainbow = stripMode == "rainbow";
+    st.colorTemp = stripColorTemp;
+    return st;
+}
+
+void markStateDirty() {
+    stateDirty = true;
+    stateChangedAt = millis();
+}
+
+void saveState() {
+    TRACE_SPAN("saveState");
+    stateDirty = false;
+    ActuatorState st = currentState();
+    if (memcmp(&st, &savedState, sizeof(st)) == 0) return;  // toggled back, nothing to write
+    prefs.putBytes("state", &st, sizeof(st));
+    savedState = st;
+    nvsWrites++;
+}
+
+// Returns false (and leaves the defaults) if nothing was saved yet.
+bool loadState() {
+    ActuatorState st = {};
+    // Blobs saved before colorTemp existed are shorter; the missing fields stay 0
+    if (prefs.getBytes("state", &st, sizeof(st)) < offsetof(ActuatorState, colorTemp)) return false;
+    savedState = st;
+    // Out-of-range fields (a corrupt blob, or one from a build with more
+    // presets) fall back to their defaults; colorTemp indexes CHANNEL_SCALES
+    ledOn = st.led == 1;
+    relayOn = st.relay == 1;
+    stripOn = st.stripOn == 1;
+    stripBrightness = st.brightness >= STRIP_MIN_BRIGHTNESS ? st.brightness : STRIP_DEFAULT_BRIGHTNESS;
+    stripColor = CRGB(st.r, st.g, st.b);
+    stripMode = st.rainbow == 1 ? "rainbow" : "solid";
+    stripColorTemp = st.colorTemp < NUM_COLOR_TEMPS ? st.colorTemp : 0;
+    ActuatorState loaded = currentState();
+    if (memcmp(&loaded, &st, sizeof(st)) != 0) {
+        Serial.println("STATE: saved state had out-of-range fields, reset to defaults");
+        markStateDirty();  // write the corrected state back
+    }
+    return true;
+}
+
+uint32_t snapshotChecksum() {
+    // FNV-1a over everything but the checksum itself
+    const uint8_t *p = (const uint8_t *)&rtcSnapshot;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(ReadingSnapshot, checksum); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+uint32_t co2SensorUptimeMs() {
+    return co2SensorBaseMs + millis();
+}
+
+// Records fresh readings (SNAP_* bits) into RTC memory and clears their stale flag.
+void saveSnapshot(uint8_t fresh) {
+    ReadingSnapshot &s = rtcSnapshot;
+    unsigned long long now = epochMs();
+    if (fresh & SNAP_CO2) {
+        s.co2ppm = co2ppm;
+        s.co2temp = co2temp;
+        s.co2error = co2error;
+        s.co2At = now;
+    }
+    if (fresh & SNAP_HTU) {
+        s.htuTemp = htuTemp;
+        s.htuHumidity = htuHumidity;
+        s.htuAt = now;
+    }
+    s.sensorUptimeMs = co2SensorUptimeMs();
+    s.checksum = snapshotChecksum();
+    staleReadings &= ~fresh;
+    validReadings |= fresh;
+}
+
+// Restores readings after a warm reset, or starts a fresh snapshot after power-on.
+void restoreSnapshot() {
+    resetReason = esp_reset_reason();
+    bool valid = rtcSnapshot.magic == SNAPSHOT_MAGIC && rtcSnapshot.checksum == snapshotChecksum();
+    warmBoot = valid && resetReason != ESP_RST_POWERON && resetReason != ESP_RST_UNKNOWN;
+    if (!warmBoot) {
+        memset(&rtcSnapshot, 0, sizeof(rtcSnapshot));
+        rtcSnapshot.magic = SNAPSHOT_MAGIC;
+        rtcSnapshot.checksum = snapshotChecksum();
+        return;
+    }
+    co2SensorBaseMs = rtcSnapshot.sensorUptimeMs;
+    if (rtcSnapshot.co2At) {
+        co2ppm = rtcSnapshot.co2ppm;
+        co2temp = rtcSnapshot.co2temp;
+        co2error = rtcSnapshot.co2error;
+        staleReadings |= SNAP_CO2;
+        validReadings |= SNAP_CO2;
+    }
+    if (rtcSnapshot.htuAt) {
+        htuTemp = rtcSnapshot.htuTemp;
+        htuHumidity = rtcSnapshot.htuHumidity;
+        staleReadings |= SNAP_HTU;
+        validReadings |= SNAP_HTU;
+    }
+}
+
+// Seconds since a snapshot reading was taken, or -1 if unknown. System time
+// is kept across soft resets, but not if it was never NTP-synced.
+long snapshotAgeSec(uint64_t at) {
+    unsigned long long now = epochMs();
+    if (!at || at < 1000000000000ULL || now < at) return -1;
+    return (now - at) / 1000;
+}
+
+// I2C bus scheduler. The OLED and HTU21D share one bus (GPIO5/6). Instead of
+// each caller holding the bus for its whole transaction, work is queued as
+// jobs that do one short bus transaction per step. i2cService() runs one step
+// of the highest-priority ready job, so loop() can service the web server in
+// between. The longest I2C stall is one step: a 72-byte OLED tile row.
+#define I2C_BUS_CLOCK 400000      // SSD1306 and HTU21D are both rated for 400kHz
+#define I2C_MAX_JOBS 4
+#define HTU21D_ADDR 0x40
+#define HTU21D_TEMP_CONV_MS 50    // 14-bit temperature, datasheet max
+#define HTU21D_HUM_CONV_MS 16     // 12-bit humidity, datasheet max
+#define HTU21D_RETRY_MS 5         // sensor NACKs reads until conversion is done
+#define HTU21D_MAX_RETRIES 10
+
+enum I2CDevice { I2C_DEV_OLED, I2C_DEV_HTU21D, I2C_DEV_COUNT };
+const char *I2C_DEV_NAMES[I2C_DEV_COUNT] = {"oled", "htu21d"};
+
+// Runs one bus transaction. Returns ms until the job's next step, or -1 when done.
+typedef long (*I2CStepFn)();
+// Runs once the job is done, outside the step timing: logging, snapshots and
+// anything else that isn't bus work.
+typedef void (*I2CDoneFn)();
+
+struct I2CJob {
+    I2CStepFn step;       // nullptr = free slot
+    I2CDoneFn done;       // optional
+    I2CDevice dev;
+    uint8_t priority;     // higher runs first
+    uint32_t readyAt;     // micros() when the next step may run
+};
+
+struct I2CStats {
+    uint64_t busyUs;      // time spent inside steps (bus occupancy)
+    uint64_t lagUs;       // ready-to-run delay: loop latency since readyAt, not bus contention
+    uint32_t maxStepUs;
+    uint32_t steps;
+};
+
+I2CJob i2cJobs[I2C_MAX_JOBS];
+I2CStats i2cStats[I2C_DEV_COUNT];
+uint32_t htuErrors = 0;
+
+// Queues a job. A job that is already queued keeps its place and state.
+bool i2cSubmit(I2CStepFn step, I2CDevice dev, uint8_t priority, I2CDoneFn done = nullptr) {
+    int free = -1;
+    for (int i = 0; i < I2C_MAX_JOBS; i++) {
+        if (i2cJobs[i].step == step) return true;
+        if (!i2cJobs[i].step && free < 0) free = i;
+    }
+    if (free < 0) {
+        Serial.printf("I2C: job queue full, dropping %s job\n", I2C_DEV_NAMES[dev]);
+        return false;
+    }
+    i2cJobs[free] = {step, done, dev, priority, (uint32_t)micros()};
+    return true;
+}
+
+void i2cService() {
+    uint32_t now = micros();
+    int best = -1;
+    for (int i = 0; i < I2C_MAX_JOBS; i++) {
+        const I2CJob &job = i2cJobs[i];
+        if (!job.step || (int32_t)(now - job.readyAt) < 0) continue;
+        if (best < 0 || job.priority > i2cJobs[best].priority) best = i;
+    }
+    if (best < 0) return;
+
+    I2CJob &job = i2cJobs[best];
+    I2CStats &st = i2cStats[job.dev];
+    st.lagUs += now - job.readyAt;
+    long next = job.step();
+    uint32_t dur = micros() - now;
+    st.busyUs += dur;
+    st.steps++;
+    if (dur > st.maxStepUs) st.maxStepUs = dur;
+    if (next < 0) {
+        job.step = nullptr;
+        if (job.done) job.done();
+    } else {
+        job.readyAt = micros() + next * 1000;
+    }
+}
+
+// OLED: one tile row (8 pixel lines, 72 bytes) per step.
+uint8_t oledRow = 0;
+
+long oledSendRow() {
+    TRACE_SPAN("i2c: oled row");
+    u8g2.updateDisplayArea(0, oledRow, u8g2.getBufferTileWidth(), 1);
+    if (++oledRow < u8g2.getBufferTileHeight()) return 0;
+    return -1;
+}
+
+// HTU21D: no-hold-master measurements, so the bus is free while the sensor
+// converts. Trigger temp, read it after the conversion time, same for humidity.
+enum HTU21DPhase { HTU_TRIGGER_TEMP, HTU_READ_TEMP, HTU_TRIGGER_HUM, HTU_READ_HUM };
+HTU21DPhase htuPhase = HTU_TRIGGER_TEMP;
+uint8_t htuRetries = 0;
+
+bool htuTrigger(uint8_t cmd) {
+    Wire.beginTransmission(HTU21D_ADDR);
+    Wire.write(cmd);
+    return Wire.endTransmission() == 0;
+}
+
+// CRC-8, polynomial x^8 + x^5 + x^4 + 1, per the HTU21D datasheet
+uint8_t htuCrc(uint16_t value) {
+    uint8_t crc = 0;
+    uint8_t data[2] = {(uint8_t)(value >> 8), (uint8_t)value};
+    for (int i = 0; i < 2; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Returns 1 with raw (status bits cleared) on success, 0 if the sensor is
+// still converting, -1 on CRC error.
+int htuReadRaw(uint16_t &raw) {
+    if (Wire.requestFrom(HTU21D_ADDR, 3) != 3) return 0;
+    uint16_t value = (Wire.read() << 8) | Wire.read();
+    uint8_t crc = Wire.read();
+    if (htuCrc(value) != crc) return -1;
+    raw = value & 0xFFFC;
+    return 1;
+}
+
+const char *htuError = nullptr;  // why the last measurement failed, nullptr if it didn't
+
+long htuFail(const char *what) {
+    htuErrors++;
+    htuError = what;
+    htuPhase = HTU_TRIGGER_TEMP;
+    return -1;
+}
+
+long htuStep() {
+    TRACE_SPAN("i2c: htu21d");
+    uint16_t raw;
+    int result;
+    switch (htuPhase) {
+    case HTU_TRIGGER_TEMP:
+        if (!htuTrigger(0xF3)) return htuFail("temp trigger NACK");
+        htuPhase = HTU_READ_TEMP;
+        htuRetries = 0;
+        return HTU21D_TEMP_CONV_MS;
+    case HTU_READ_TEMP:
+        result = htuReadRaw(raw);
+        if (result == 0 && ++htuRetries < HTU21D_MAX_RETRIES) return HTU21D_RETRY_MS;
+        if (result != 1) return htuFail(result == 0 ? "temp timeout" : "temp CRC error");
+        htuTemp = -46.85 + 175.72 * raw / 65536.0;
+        htuPhase = HTU_TRIGGER_HUM;
+        return 0;
+    case HTU_TRIGGER_HUM:
+        if (!htuTrigger(0xF5)) return htuFail("humidity trigger NACK");
+        htuPhase = HTU_READ_HUM;
+        htuRetries = 0;
+        return HTU21D_HUM_CONV_MS;
+    case HTU_READ_HUM:
+        result = htuReadRaw(raw);
+        if (result == 0 && ++htuRetries < HTU21D_MAX_RETRIES) return HTU21D_RETRY_MS;
+        if (result != 1) return htuFail(result == 0 ? "humidity timeout" : "humidity CRC error");
+        htuHumidity = constrain(-6.0 + 125.0 * raw / 65536.0, 0.0, 100.0);
+        htuPhase = HTU_TRIGGER_TEMP;
+        htuError = nullptr;
+        return -1;
+    }
+    return -1;
+}
+
+void htuDone() {
+    if (htuError) {
+        Serial.printf("HTU21D: %s\n", htuError);
+        return;
+    }
+    saveSnapshot(SNAP_HTU);
+    Serial.printf("HTU21D: %.1f C  %.1f %%RH\n", htuTemp, htuHumidity);
+}
+
 void updateOled() {
+    TRACE_SPAN("updateOled");
     u8g2.clearBuffer();
     u8g2.setFont(u8g2_font_6x10_tr);
 
@@ -100,7 +536,9 @@ void updateOled() {
     snprintf(line3, sizeof(line3), "%.1fC %.0f%%", htuTemp, htuHumidity);
     u8g2.drawStr(0, 32, line3);
 
-    u8g2.sendBuffer();
+    // Send row by row from i2cService(); a redraw mid-frame restarts the frame
+    oledRow = 0;
+    i2cSubmit(oledSendRow, I2C_DEV_OLED, 0);
 }
 
 const char *PAGE = R"rawliteral(
@@ -179,6 +617,14 @@ const char *PAGE = R"rawliteral(
     <button id="rainbowbtn" onclick="setMode('rainbow')" style="font-size:0.85em;padding:6px 12px;margin:0">Rainbow</button>
     <button id="solidbtn" onclick="setMode('solid')" style="font-size:0.85em;padding:6px 12px;margin:0">Solid</button>
     <input type="color" id="stripclr" value="#ffffff" onchange="setStrip()" style="height:32px;width:32px;border:none;padding:0;cursor:pointer">
+    <select id="striptemp" onchange="setStrip()" style="height:32px;background:#2a2a2a;color:#e0e0e0;border:1px solid #3a3a3a;border-radius:6px">
+      <option value="neutral">Neutral</option>
+      <option value="candle">Candle</option>
+      <option value="tungsten">Tungsten</option>
+      <option value="halogen">Halogen</option>
+      <option value="overcast">Overcast</option>
+      <option value="clearsky">Clear sky</option>
+    </select>
   </div>
   <div style="margin-top:8px">
     <input type="range" id="stripbri" min="2" max="255" value="128" style="width:100%" oninput="queueStrip()">
@@ -214,7 +660,9 @@ function toggleLed() {
   var t0 = Date.now();
   fetch('/led?on=' + want + '&t=' + t0).then(function(r){return r.text()}).then(function(s){console.log('LED round-trip: ' + (Date.now()-t0) + 'ms');setLed(s);actionsPending--}).catch(function(){actionsPending--});
 }
+var staleMask = 0;
 function syncAll(d) {
+  staleMask = d.stale || 0;
   setLed(d.led ? 'ON' : 'OFF');
   setRelay(d.relay ? 'ON' : 'OFF');
   syncStrip(d);
@@ -240,11 +688,17 @@ function updateBatt() {
 }
 updateBatt();
 setInterval(updateBatt, 10000);
-var co2Loaded = false, co2Result = 0, co2Ppm = 0, co2Uptime = 0, co2UptimeAt = Date.now();
+var co2Loaded = false, co2Result = 0, co2Ppm = 0, co2Stale = false, co2Uptime = 0, co2UptimeAt = Date.now();
 function renderCO2() {
   if (!co2Loaded) return;
   var el = document.getElementById('co2val');
   var label = document.getElementById('co2label');
+  if (co2Stale) {
+    el.innerText = co2Ppm || '--';
+    el.style.color = '#888';
+    label.innerText = 'CO2 (before reboot)';
+    return;
+  }
   if (co2Result !== 1) {
     var errNames = {0:'no response',2:'timeout',3:'desync',4:'CRC error',5:'filter'};
     el.innerText = co2Ppm || '--';
@@ -267,7 +721,7 @@ function renderCO2() {
 }
 function updateCO2() {
   fetch('/co2status').then(function(r){return r.json()}).then(function(d) {
-    co2Result = d.result; co2Ppm = d.ppm; co2Uptime = d.uptime; co2UptimeAt = Date.now();
+    co2Result = d.result; co2Ppm = d.ppm; co2Stale = d.stale === 1; co2Uptime = d.uptime; co2UptimeAt = Date.now();
     co2Loaded = true;
     renderCO2();
   });
@@ -280,13 +734,14 @@ function updateHTU() {
     var el = document.getElementById('htutemp');
     var t = parseFloat(v);
     el.innerText = t.toFixed(1) + '\u00B0C';
-    el.style.color = '#22c55e';
+    el.style.color = (staleMask & 2) ? '#888' : '#22c55e';
   });
   fetch('/humidity').then(function(r){return r.text()}).then(function(v) {
     var el = document.getElementById('htuhum');
     var h = parseFloat(v);
     el.innerText = h.toFixed(1) + '%';
-    if (h <= 60) el.style.color = '#22c55e';
+    if (staleMask & 2) el.style.color = '#888';
+    else if (h <= 60) el.style.color = '#22c55e';
     else if (h <= 70) el.style.color = '#eab308';
     else el.style.color = '#ef4444';
   });
@@ -328,6 +783,7 @@ function syncStrip(d) {
   if (d.mode) stripMode = d.mode;
   updateStripBtns();
   document.getElementById('stripbri').value = d.brightness;
+  if (d.temp) document.getElementById('striptemp').value = d.temp;
   if (d.r !== undefined) {
     var hex = '#' + ('0'+d.r.toString(16)).slice(-2) + ('0'+d.g.toString(16)).slice(-2) + ('0'+d.b.toString(16)).slice(-2);
     document.getElementById('stripclr').value = hex;
@@ -362,7 +818,8 @@ function setStrip() {
   var r = parseInt(c.substr(1,2),16);
   var g = parseInt(c.substr(3,2),16);
   var bl = parseInt(c.substr(5,2),16);
-  fetch('/strip?on=' + (stripIsOn?1:0) + '&brightness=' + b + '&r=' + r + '&g=' + g + '&b=' + bl + '&t=' + Date.now()).then(function(){
+  var tp = document.getElementById('striptemp').value;
+  fetch('/strip?on=' + (stripIsOn?1:0) + '&brightness=' + b + '&r=' + r + '&g=' + g + '&b=' + bl + '&temp=' + tp + '&t=' + Date.now()).then(function(){
     actionsPending--;
     stripSending = false;
     if (stripDirty) setStrip();
@@ -374,14 +831,17 @@ function setStrip() {
 )rawliteral";
 
 void handleRoot() {
+    TRACE_SPAN("handleRoot");
     server.send(200, "text/html", PAGE);
 }
 
 void handleStatus() {
+    TRACE_SPAN("handleStatus");
     server.send(200, "text/plain", ledOn ? "ON" : "OFF");
 }
 
 void handleLed() {
+    TRACE_SPAN("handleLed");
     dbg("LED", "request received");
     dbgClient("LED");
     if (server.hasArg("on")) {
@@ -390,6 +850,7 @@ void handleLed() {
         ledOn = !ledOn;
     }
     digitalWrite(LED_PIN, ledOn ? LOW : HIGH); // inverted logic
+    markStateDirty();
     dbg("LED", ledOn ? "actuated ON" : "actuated OFF");
     updateOled();
     dbg("LED", "oled updated");
@@ -398,6 +859,7 @@ void handleLed() {
 }
 
 void handleRelay() {
+    TRACE_SPAN("handleRelay");
     dbg("RELAY", "request received");
     dbgClient("RELAY");
     if (server.hasArg("on")) {
@@ -406,28 +868,33 @@ void handleRelay() {
         relayOn = !relayOn;
     }
     digitalWrite(RELAY_PIN, relayOn ? HIGH : LOW);
+    markStateDirty();
     dbg("RELAY", relayOn ? "actuated ON" : "actuated OFF");
     server.send(200, "text/plain", relayOn ? "ON" : "OFF");
     dbg("RELAY", "response sent");
 }
 
 void handleRelayStatus() {
+    TRACE_SPAN("handleRelayStatus");
     server.send(200, "text/plain", relayOn ? "ON" : "OFF");
 }
 
 void handleBattery() {
+    TRACE_SPAN("handleBattery");
     char buf[8];
     snprintf(buf, sizeof(buf), "%.2f", batteryVoltage);
     server.send(200, "text/plain", buf);
 }
 
 void readBattery() {
+    TRACE_SPAN("readBattery");
     int mv = analogReadMilliVolts(BATTERY_PIN);
     batteryVoltage = mv * 2.0 / 1000.0;
     Serial.printf("Battery: %.2fV\n", batteryVoltage);
 }
 
 void sendNtfyAlert() {
+    TRACE_SPAN("sendNtfyAlert");
     HTTPClient http;
     http.begin(NTFY_BATTERY);
     http.addHeader("Title", "ESP32 Room Controller - Battery Low");
@@ -441,21 +908,25 @@ void sendNtfyAlert() {
 }
 
 void handleCO2() {
+    TRACE_SPAN("handleCO2");
     char buf[8];
     snprintf(buf, sizeof(buf), "%d", co2ppm);
     server.send(200, "text/plain", buf);
 }
 
 void handleCO2Temp() {
+    TRACE_SPAN("handleCO2Temp");
     char buf[8];
     snprintf(buf, sizeof(buf), "%d", co2temp);
     server.send(200, "text/plain", buf);
 }
 
 void handleCO2Status() {
-    char buf[64];
-    unsigned long uptime = millis() / 1000;
-    snprintf(buf, sizeof(buf), "{\"result\":%d,\"uptime\":%lu,\"ppm\":%d}", co2error, uptime, co2ppm);
+    TRACE_SPAN("handleCO2Status");
+    char buf[80];
+    unsigned long uptime = co2SensorUptimeMs() / 1000;  // sensor on-time, drives the UI warmup countdown
+    snprintf(buf, sizeof(buf), "{\"result\":%d,\"uptime\":%lu,\"ppm\":%d,\"stale\":%d}",
+        co2error, uptime, co2ppm, (staleReadings & SNAP_CO2) ? 1 : 0);
     server.send(200, "application/json", buf);
 }
 
@@ -473,36 +944,76 @@ void readCO2() {
     }
 }
 
+// Queues a temp + humidity read; results land in htuTemp/htuHumidity.
+// Higher priority than the OLED so a redraw can't delay a reading.
 void readHTU21D() {
-    htuTemp = htu.readTemperature();
-    server.handleClient();
-    htuHumidity = htu.readHumidity();
-    Serial.printf("HTU21D: %.1f C  %.1f %%RH\n", htuTemp, htuHumidity);
+    TRACE_SPAN("readHTU21D");
+    i2cSubmit(htuStep, I2C_DEV_HTU21D, 1, htuDone);
+}
+
+// LED strip colour pipeline (LUTs and renderStrip() in lib/StripPipeline).
+// FastLED's own brightness, correction and dithering are disabled in setup().
+#define STRIP_DITHER_INTERVAL 8   // ms between dithered frames (show() is ~1ms for 30 LEDs)
+
+CRGB stripFrame[NUM_LEDS];           // colours before the pipeline
+uint8_t stripResidue[NUM_LEDS][3];   // dither carry, 1/256ths of a level
+bool stripDithering = false;         // last frame had visible fractional levels
+unsigned long lastStripFrame = 0;
+
+int colorTempIndex(const String &name) {
+    for (int i = 0; i < NUM_COLOR_TEMPS; i++) {
+        if (name == COLOR_TEMPS[i].name) return i;
+    }
+    return -1;
+}
+
+void showStrip() {
+    TRACE_SPAN("FastLED.show");
+    FastLED.show();
 }
 
 void updateStrip() {
     if (!stripOn) {
         FastLED.clear();
-        FastLED.show();
+        showStrip();
+        stripDithering = false;
         return;
     }
-    FastLED.setBrightness(stripBrightness);
     if (stripMode == "solid") {
-        fill_solid(leds, NUM_LEDS, stripColor);
+        fill_solid(stripFrame, NUM_LEDS, stripColor);
     } else if (stripMode == "rainbow") {
-        fill_rainbow(leds, NUM_LEDS, rainbowHue++, 255 / NUM_LEDS);
+        fill_rainbow(stripFrame, NUM_LEDS, rainbowHue++, 255 / NUM_LEDS);
     }
+    uint32_t mult[3];
+    stripMultipliers(stripColorTemp, stripBrightness, mult);
+    {
+        TRACE_SPAN("strip: render");
+        stripDithering = renderStrip(stripFrame, leds, mult, stripResidue);
+    }
+    lastStripFrame = millis();
+    showStrip();
+}
+
+// Another frame of the same colours so dim levels keep dithering. Not traced:
+// at one frame per STRIP_DITHER_INTERVAL it would push everything else out of
+// the trace ring.
+void ditherStrip() {
+    uint32_t mult[3];
+    stripMultipliers(stripColorTemp, stripBrightness, mult);
+    stripDithering = renderStrip(stripFrame, leds, mult, stripResidue);
+    lastStripFrame = millis();
     FastLED.show();
 }
 
 void handleStrip() {
+    TRACE_SPAN("handleStrip");
     dbg("STRIP", "request received");
     dbgClient("STRIP");
     if (server.hasArg("on")) {
         stripOn = server.arg("on") == "1";
     }
     if (server.hasArg("brightness")) {
-        stripBrightness = server.arg("brightness").toInt();
+        stripBrightness = constrain(server.arg("brightness").toInt(), STRIP_MIN_BRIGHTNESS, 255);
     }
     if (server.hasArg("mode")) {
         stripMode = server.arg("mode");
@@ -510,57 +1021,489 @@ void handleStrip() {
     if (server.hasArg("r") && server.hasArg("g") && server.hasArg("b")) {
         stripColor = CRGB(server.arg("r").toInt(), server.arg("g").toInt(), server.arg("b").toInt());
     }
+    if (server.hasArg("temp")) {
+        int preset = colorTempIndex(server.arg("temp"));
+        if (preset >= 0) stripColorTemp = preset;
+    }
     dbg("STRIP", "params parsed");
-    if (server.args() > 0) updateStrip();
+    if (server.args() > 0) {
+        updateStrip();
+        markStateDirty();
+    }
     dbg("STRIP", "strip updated");
 
-    char buf[96];
-    snprintf(buf, sizeof(buf), "{\"on\":%d,\"brightness\":%d,\"mode\":\"%s\",\"r\":%d,\"g\":%d,\"b\":%d}",
-        stripOn ? 1 : 0, stripBrightness, stripMode.c_str(), stripColor.r, stripColor.g, stripColor.b);
+    char buf[128];
+    snprintf(buf, sizeof(buf), "{\"on\":%d,\"brightness\":%d,\"mode\":\"%s\",\"r\":%d,\"g\":%d,\"b\":%d,\"temp\":\"%s\"}",
+        stripOn ? 1 : 0, stripBrightness, stripMode.c_str(), stripColor.r, stripColor.g, stripColor.b,
+        COLOR_TEMPS[stripColorTemp].name);
     server.send(200, "application/json", buf);
     dbg("STRIP", "response sent");
 }
 
 void handlePoll() {
+    TRACE_SPAN("handlePoll");
     dbg("POLL", "request received");
-    char buf[128];
+    char buf[160];
     snprintf(buf, sizeof(buf),
-        "{\"led\":%d,\"relay\":%d,\"on\":%d,\"brightness\":%d,\"mode\":\"%s\",\"r\":%d,\"g\":%d,\"b\":%d}",
+        "{\"led\":%d,\"relay\":%d,\"on\":%d,\"brightness\":%d,\"mode\":\"%s\",\"r\":%d,\"g\":%d,\"b\":%d,\"temp\":\"%s\",\"stale\":%d}",
         ledOn ? 1 : 0, relayOn ? 1 : 0, stripOn ? 1 : 0,
         stripBrightness, stripMode.c_str(),
-        stripColor.r, stripColor.g, stripColor.b);
+        stripColor.r, stripColor.g, stripColor.b, COLOR_TEMPS[stripColorTemp].name, staleReadings);
     server.send(200, "application/json", buf);
     dbg("POLL", "response sent");
 }
 
 void handleTemp() {
+    TRACE_SPAN("handleTemp");
     char buf[8];
     snprintf(buf, sizeof(buf), "%.1f", htuTemp);
     server.send(200, "text/plain", buf);
 }
 
 void handleHumidity() {
+    TRACE_SPAN("handleHumidity");
     char buf[8];
     snprintf(buf, sizeof(buf), "%.1f", htuHumidity);
     server.send(200, "text/plain", buf);
 }
 
+// Dumps the last s= seconds of the trace ring as Chrome trace_event JSON.
+// Tracing is paused while streaming so the dump doesn't overwrite itself.
+void handleTrace() {
+    uint32_t seconds = TRACE_DEFAULT_SECONDS;
+    if (server.hasArg("s")) {
+        seconds = constrain(server.arg("s").toInt(), 1, TRACE_MAX_SECONDS);
+    }
+    traceEnabled = false;
+    uint32_t now = micros();
+    uint32_t window = seconds * 1000000UL;
+    uint32_t base = now - window;  // ts in the dump is relative to window start
+
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "application/json", "");
+
+    char chunk[1024];
+    int len = snprintf(chunk, sizeof(chunk),
+        "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"overhead_ns\":%lu,\"capacity\":%d,\"seconds\":%lu},\"traceEvents\":[",
+        (unsigned long)traceOverheadNs, TRACE_BUFFER_SIZE, (unsigned long)seconds);
+    bool first = true;
+    uint16_t oldest = (traceHead - traceCount) & (TRACE_BUFFER_SIZE - 1);
+    for (uint16_t i = 0; i < traceCount; i++) {
+        const TraceEvent &e = traceBuf[(oldest + i) & (TRACE_BUFFER_SIZE - 1)];
+        if (now - (e.start + e.dur) > window) continue;
+        char ev[128];
+        int evLen;
+        if (e.ph == 'X') {
+            evLen = snprintf(ev, sizeof(ev), "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%lu,\"pid\":1,\"tid\":1}",
+                first ? "" : ",", e.name, (long)(int32_t)(e.start - base), (unsigned long)e.dur);
+        } else {
+            evLen = snprintf(ev, sizeof(ev), "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%ld,\"pid\":1,\"tid\":1}",
+                first ? "" : ",", e.name, (long)(int32_t)(e.start - base));
+        }
+        first = false;
+        if (len + evLen >= (int)sizeof(chunk)) {
+            server.sendContent(chunk, len);
+            len = 0;
+        }
+        memcpy(chunk + len, ev, evLen);
+        len += evLen;
+    }
+    server.sendContent(chunk, len);
+    server.sendContent("]}");
+    server.sendContent("");
+    traceEnabled = true;
+}
+
+// OTA firmware update. POST the raw image to port OTA_PORT:
+//   curl --data-binary @firmware.bin http://<ip>:8080/update?sha256=<hex>
+// It has its own listener rather than a WebServer route because the
+// WebServer reads a whole upload inside one handleClient() call. Here
+// loop() hands otaService() one chunk (OTA_CHUNK) per pass, so sensors, the
+// strip and every other endpoint, /relay, /led and /strip included, keep
+// being served during an upload and while a slow link stalls.
+// Parsing, hashing and the verify/commit decision are in lib/OtaUpdate.
+// Chunks go straight into the inactive app partition, so RAM use doesn't
+// depend on image size, and the boot partition is only switched if the
+// SHA-256 of the received bytes matches. The new image must then mark
+// itself healthy (WiFi up for OTA_HEALTHY_AFTER ms) and is rejected if it
+// hasn't by OTA_HEALTH_DEADLINE. Who rolls back depends on the bootloader:
+// - built with CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE, it keeps the new image
+//   in pending-verify and boots the previous one after any reset before
+//   that. The prebuilt Arduino-ESP32 bootloader that `pio run` ships is not
+//   built with it, so this needs a custom sdkconfig.
+// - otherwise (the default) the firmware counts boots of the new image in NVS
+//   and switches back after OTA_MAX_BOOT_ATTEMPTS.
+// otaCheckRollback() finds out at boot which of the two is in charge.
+#define OTA_PORT 8080
+#define OTA_HEALTHY_AFTER 60000
+#define OTA_HEALTH_DEADLINE 300000
+#define OTA_MAX_BOOT_ATTEMPTS 3
+
+bool otaPendingVerify = false;  // running a new image that hasn't been marked healthy
+bool otaBootloaderVerify = false;  // the bootloader tracks it (ESP_OTA_IMG_PENDING_VERIFY)
+bool otaRolledBack = false;  // this boot came back from an image that failed verification
+
+// Stops initArduino() from marking a pending image valid before setup() runs;
+// otaCheckHealthy() does that once the image has proven itself. The core's
+// weak default is in a C file, so this has to have C linkage to replace it.
+extern "C" bool verifyRollbackLater() { return true; }
+
+class UpdateFlashSink : public OtaFlashSink {
+public:
+    bool begin(uint32_t size) override {
+        return Update.begin(size, U_FLASH);
+    }
+
+    bool write(const uint8_t *data, size_t len) override {
+        TRACE_SPAN("ota: flash write");
+        return Update.write((uint8_t *)data, len) == len;
+    }
+
+    // Switches the boot partition and arms the rollback check for next boot
+    bool commit() override {
+        if (!Update.end(true)) return false;
+        const esp_partition_t *next = esp_ota_get_boot_partition();
+        prefs.putString("otaPart", next ? next->label : "");
+        prefs.putBool("otaPending", true);
+        prefs.putUChar("otaBoots", 0);
+        return true;
+    }
+
+    void abort() override {
+        Update.abort();
+    }
+};
+
+class WiFiOtaStream : public OtaStream {
+public:
+    int read(uint8_t *buf, size_t size) override {
+        int queued = client.available();
+        if (queued <= 0) return client.connected() ? 0 : -1;
+        return client.read(buf, min((size_t)queued, size));
+    }
+
+    void write(const char *data, size_t len) override {
+        client.write((const uint8_t *)data, len);
+    }
+
+    void close() override {
+        client.stop();
+    }
+
+    WiFiClient client;
+};
+
+WiFiServer otaServer(OTA_PORT);
+UpdateFlashSink otaFlash;
+WiFiOtaStream otaStream;
+OtaHttpUpload otaUpload(otaFlash);
+
+size_t otaHeapUsed() {
+    return ESP.getHeapSize() - ESP.getFreeHeap();
+}
+
+// Called every loop(): accepts an upload, or moves the current one on by at
+// most one chunk. Reboots into the new image once it has been committed.
+void otaService() {
+    if (!otaUpload.busy()) {
+        otaStream.client = otaServer.available();
+        if (!otaStream.client) return;
+        Serial.printf("OTA: upload from %s\n", otaStream.client.remoteIP().toString().c_str());
+        otaUpload.start(otaStream, millis());
+        otaActive = true;
+    }
+    {
+        TRACE_SPAN("ota: service");
+        if (otaUpload.service(millis())) return;
+    }
+    otaActive = false;
+    Serial.printf("OTA: %s\n", otaUpload.response());
+    if (otaUpload.succeeded()) {
+        delay(200);  // let the response go out
+        ESP.restart();
+    }
+}
+
+// Runs early in setup(). If the bootloader has the running image in
+// pending-verify it owns rollback and this only notes it. Otherwise the NVS
+// counter does the same job: boots of the new image are counted and once it
+// has had too many tries the other app partition is made bootable again.
+void otaCheckRollback() {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY) {
+        otaBootloaderVerify = true;
+        otaPendingVerify = true;
+        Serial.printf("OTA: new image on %s, waiting to verify\n", running->label);
+        return;
+    }
+    if (!prefs.getBool("otaPending", false)) return;
+    if (prefs.getString("otaPart", "") != running->label) {
+        // Already back on the previous image
+        prefs.putBool("otaPending", false);
+        otaRolledBack = true;
+        Serial.println("OTA: new image was rolled back");
+        return;
+    }
+    uint8_t boots = prefs.getUChar("otaBoots", 0) + 1;
+    if (boots > OTA_MAX_BOOT_ATTEMPTS) {
+        // otaPending stays set so the previous image can report the rollback
+        const esp_partition_t *previous = esp_ota_get_next_update_partition(NULL);
+        Serial.printf("OTA: image never marked healthy, rolling back to %s\n", previous ? previous->label : "?");
+        if (previous && esp_ota_set_boot_partition(previous) == ESP_OK) ESP.restart();
+        prefs.putBool("otaPending", false);
+        return;
+    }
+    prefs.putUChar("otaBoots", boots);
+    otaPendingVerify = true;
+    Serial.printf("OTA: new image, boot %d/%d before rollback\n", boots, OTA_MAX_BOOT_ATTEMPTS);
+}
+
+// Gives up on an unverified image: the bootloader switches back straight away,
+// the NVS fallback counts this as a failed boot.
+void otaRejectImage(const char *why) {
+    Serial.printf("OTA: %s, rejecting new image\n", why);
+    Serial.flush();
+    if (otaBootloaderVerify) esp_ota_mark_app_invalid_rollback_and_reboot();
+    ESP.restart();
+}
+
+void otaCheckHealthy() {
+    if (!otaPendingVerify) return;
+    if (millis() >= OTA_HEALTH_DEADLINE) {
+        otaRejectImage("not healthy before deadline");
+        return;
+    }
+    if (millis() < OTA_HEALTHY_AFTER || WiFi.status() != WL_CONNECTED) return;
+    otaPendingVerify = false;
+    prefs.putBool("otaPending", false);
+    if (otaBootloaderVerify) esp_ota_mark_app_valid_cancel_rollback();
+    Serial.println("OTA: image marked healthy");
+}
+
+void handleBootInfo() {
+    TRACE_SPAN("handleBootInfo");
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+        "{\"reason\":%d,\"warm\":%d,\"restore_ms\":%lu,\"stale\":%d,\"co2_age_s\":%ld,\"htu_age_s\":%ld,\"nvs_writes\":%lu,"
+        "\"ota_pending\":%d,\"ota_bootloader_rollback\":%d,\"ota_rolled_back\":%d}",
+        (int)resetReason, warmBoot ? 1 : 0, bootRestoreMs, staleReadings,
+        snapshotAgeSec(rtcSnapshot.co2At), snapshotAgeSec(rtcSnapshot.htuAt), (unsigned long)nvsWrites,
+        otaPendingVerify ? 1 : 0, otaBootloaderVerify ? 1 : 0, otaRolledBack ? 1 : 0);
+    server.send(200, "application/json", buf);
+}
+
+void handleI2C() {
+    TRACE_SPAN("handleI2C");
+    unsigned long uptimeMs = millis();
+    char buf[512];
+    int len = snprintf(buf, sizeof(buf), "{\"clock\":%d,\"uptime_ms\":%lu,\"htu_errors\":%lu,\"devices\":{",
+        I2C_BUS_CLOCK, uptimeMs, (unsigned long)htuErrors);
+    for (int d = 0; d < I2C_DEV_COUNT; d++) {
+        const I2CStats &st = i2cStats[d];
+        float occupancy = uptimeMs ? st.busyUs / (uptimeMs * 10.0) : 0;  // percent
+        len += snprintf(buf + len, sizeof(buf) - len,
+            "%s\"%s\":{\"busy_us\":%llu,\"lag_us\":%llu,\"max_step_us\":%lu,\"steps\":%lu,\"occupancy_pct\":%.3f}",
+            d ? "," : "", I2C_DEV_NAMES[d], (unsigned long long)st.busyUs, (unsigned long long)st.lagUs,
+            (unsigned long)st.maxStepUs, (unsigned long)st.steps, occupancy);
+    }
+    snprintf(buf + len, sizeof(buf) - len, "}}");
+    server.send(200, "application/json", buf);
+}
+
+// Multi-room hub. Every controller multicasts a compact state packet when a
+// reading or actuator changes (plus a heartbeat), and every controller keeps
+// a table of the rooms it hears. Nodes built with ROOM_HUB_CANDIDATE elect the
+// candidate with the lowest node ID as hub; /rooms on any other node redirects
+// there. If the hub goes quiet for ROOM_HUB_TIMEOUT, the next candidate takes
+// over, and with no hub at all each node answers /rooms from its own table.
+// The protocol lives in lib/RoomHub; this is the WiFiUDP transport and glue.
+#ifndef ROOM_NAME
+#define ROOM_NAME ""              // empty = "room-" + last MAC bytes
+#endif
+#ifndef ROOM_HUB_CANDIDATE
+#define ROOM_HUB_CANDIDATE 0
+#endif
+#define ROOM_PORT 4210
+
+const IPAddress ROOM_GROUP(239, 255, 42, 1);
+
+class WiFiRoomSocket : public RoomSocket {
+public:
+    bool begin() { return udp.beginMulticast(ROOM_GROUP, ROOM_PORT); }
+
+    int receive(uint8_t *buf, size_t size, uint32_t &fromIp) override {
+        int len = udp.parsePacket();
+        if (!len) return 0;
+        TRACE_SPAN("rooms: receive");
+        udp.read(buf, min((size_t)len, size));
+        udp.flush();
+        fromIp = udp.remoteIP();
+        return len;
+    }
+
+    bool send(const uint8_t *buf, size_t len) override {
+        TRACE_SPAN("rooms: send");
+        udp.beginMulticastPacket();
+        udp.write(buf, len);
+        return udp.endPacket();
+    }
+
+private:
+    WiFiUDP udp;
+};
+
+WiFiRoomSocket roomSocket;
+RoomNode roomNode(roomSocket);
+bool roomsStarted = false;
+
+RoomPacket roomCurrentState() {
+    RoomPacket p = {};
+    p.flags = (ledOn ? ROOM_FLAG_LED : 0) | (relayOn ? ROOM_FLAG_RELAY : 0) | (stripOn ? ROOM_FLAG_STRIP : 0)
+        | ((validReadings & SNAP_CO2) ? ROOM_FLAG_CO2_VALID : 0)
+        | ((validReadings & SNAP_HTU) ? ROOM_FLAG_HTU_VALID : 0)
+        | ((staleReadings & SNAP_CO2) ? ROOM_FLAG_CO2_STALE : 0)
+        | ((staleReadings & SNAP_HTU) ? ROOM_FLAG_HTU_STALE : 0);
+    p.co2ppm = co2ppm;
+    p.co2error = co2error;
+    p.temp10 = lroundf(htuTemp * 10);
+    p.humidity10 = lroundf(htuHumidity * 10);
+    p.batteryMv = lroundf(batteryVoltage * 1000);
+    return p;
+}
+
+void roomsBegin() {
+    uint8_t mac[6];
+    WiFi.macAddress(mac);
+    uint32_t nodeId = (uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 | mac[4] << 8 | mac[5];
+    char name[ROOM_NAME_LEN + 1];
+    if (ROOM_NAME[0]) {
+        strlcpy(name, ROOM_NAME, sizeof(name));
+    } else {
+        snprintf(name, sizeof(name), "room-%02x%02x", mac[4], mac[5]);
+    }
+    roomNode.begin(nodeId, name, ROOM_HUB_CANDIDATE);
+    roomNode.onJoin = [](const RoomEntry &r) {
+        Serial.printf("ROOMS: new room %.16s at %s\n", r.state.name, IPAddress(r.ip).toString().c_str());
+    };
+    roomNode.onExpire = [](const RoomEntry &r) {
+        Serial.printf("ROOMS: %.16s timed out\n", r.state.name);
+    };
+    roomsStarted = roomSocket.begin();
+    Serial.printf("ROOMS: %.16s (node %08lx)%s, multicast %s\n", roomNode.self().name, (unsigned long)nodeId,
+        ROOM_HUB_CANDIDATE ? " hub candidate" : "", roomsStarted ? "OK" : "FAILED");
+}
+
+void roomsService() {
+    if (!roomsStarted) return;
+    roomNode.service(millis(), roomCurrentState(), WiFi.localIP());
+}
+
+// Aggregated view of all rooms. Non-hub nodes redirect to the hub unless
+// ?local=1; history=1 adds the per-room samples (oldest first).
+void handleRooms() {
+    TRACE_SPAN("handleRooms");
+    unsigned long now = millis();
+    const RoomEntry *hub = roomNode.hub(now);
+    bool isHub = roomNode.isHub(now);
+    bool history = server.arg("history") == "1";
+    if (hub && !isHub && server.arg("local") != "1") {
+        String url = "http://" + IPAddress(hub->ip).toString() + "/rooms" + (history ? "?history=1" : "");
+        server.sendHeader("Location", url.c_str());
+        server.send(307, "text/plain", "");
+        return;
+    }
+
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "application/json", "");
+    char buf[320];
+    snprintf(buf, sizeof(buf), "{\"self\":\"%.16s\",\"is_hub\":%d,\"hub\":\"%.16s\",\"rooms\":[",
+        roomNode.self().name, isHub ? 1 : 0, hub ? hub->state.name : "");
+    server.sendContent(buf);
+    bool first = true;
+    for (int i = 0; i < ROOM_MAX; i++) {
+        const RoomEntry &r = roomNode.rooms[i];
+        if (!r.used) continue;
+        const RoomPacket &p = r.state;
+        // Readings a room hasn't taken yet are null rather than 0
+        char co2[8] = "null", temp[8] = "null", humidity[8] = "null";
+        if (p.flags & ROOM_FLAG_CO2_VALID) snprintf(co2, sizeof(co2), "%d", p.co2ppm);
+        if (p.flags & ROOM_FLAG_HTU_VALID) {
+            snprintf(temp, sizeof(temp), "%.1f", p.temp10 / 10.0);
+            snprintf(humidity, sizeof(humidity), "%.1f", p.humidity10 / 10.0);
+        }
+        snprintf(buf, sizeof(buf),
+            "%s{\"name\":\"%.16s\",\"ip\":\"%s\",\"age_s\":%lu,\"co2\":%s,\"co2_error\":%d,"
+            "\"temp\":%s,\"humidity\":%s,\"co2_stale\":%d,\"htu_stale\":%d,\"battery\":%.2f,"
+            "\"led\":%d,\"relay\":%d,\"strip\":%d,\"hub_candidate\":%d",
+            first ? "" : ",", p.name, IPAddress(r.ip).toString().c_str(), (now - r.lastSeen) / 1000,
+            co2, p.co2error, temp, humidity,
+            (p.flags & ROOM_FLAG_CO2_STALE) ? 1 : 0, (p.flags & ROOM_FLAG_HTU_STALE) ? 1 : 0, p.batteryMv / 1000.0,
+            (p.flags & ROOM_FLAG_LED) ? 1 : 0, (p.flags & ROOM_FLAG_RELAY) ? 1 : 0,
+            (p.flags & ROOM_FLAG_STRIP) ? 1 : 0, (p.flags & ROOM_FLAG_CANDIDATE) ? 1 : 0);
+        server.sendContent(buf);
+        first = false;
+        if (history) {
+            // Batch samples into buf rather than one TCP write each
+            int len = snprintf(buf, sizeof(buf), ",\"history\":[");
+            int oldest = (r.historyHead + ROOM_HISTORY_LEN - r.historyCount) % ROOM_HISTORY_LEN;
+            for (int h = 0; h < r.historyCount; h++) {
+                if (len > (int)sizeof(buf) - 32) {
+                    server.sendContent(buf, len);
+                    len = 0;
+                }
+                const RoomSample &s = r.history[(oldest + h) % ROOM_HISTORY_LEN];
+                char co2[8] = "null", temp[8] = "null", humidity[8] = "null";
+                if (s.flags & ROOM_FLAG_CO2_VALID) snprintf(co2, sizeof(co2), "%d", s.co2ppm);
+                if (s.flags & ROOM_FLAG_HTU_VALID) {
+                    snprintf(temp, sizeof(temp), "%.1f", s.temp10 / 10.0);
+                    snprintf(humidity, sizeof(humidity), "%.1f", s.humidity10 / 10.0);
+                }
+                len += snprintf(buf + len, sizeof(buf) - len, "%s[%s,%s,%s]", h ? "," : "", co2, temp, humidity);
+            }
+            server.sendContent(buf, len);
+            server.sendContent("]");
+        }
+        server.sendContent("}");
+    }
+    server.sendContent("]}");
+    server.sendContent("");
+}
+
 void setup() {
     Serial.begin(115200);
 
+    // Saved actuator state (NVS) and last readings (RTC memory), before anything slow
+    prefs.begin("room", false);
+    otaCheckRollback();
+    bool stateLoaded = loadState();
+    restoreSnapshot();
+
     // Onboard LED
     pinMode(LED_PIN, OUTPUT);
-    digitalWrite(LED_PIN, HIGH); // OFF (inverted)
+    digitalWrite(LED_PIN, ledOn ? LOW : HIGH); // inverted
 
     // Relay
     pinMode(RELAY_PIN, OUTPUT);
-    digitalWrite(RELAY_PIN, LOW); // OFF (active-high, inverted by transistor)
+    digitalWrite(RELAY_PIN, relayOn ? HIGH : LOW); // active-high, inverted by transistor
 
     // LED strip
+    // Brightness, correction and dithering happen in renderStrip()
     FastLED.addLeds<WS2813, LED_STRIP_PIN, GRB>(leds, NUM_LEDS);
-    FastLED.setCorrection(TypicalLEDStrip);
+    FastLED.setCorrection(UncorrectedColor);
+    FastLED.setBrightness(255);
+    FastLED.setDither(DISABLE_DITHER);
+    stripSeedResidue(stripResidue);
     FastLED.clear();
-    FastLED.show();
+    updateStrip();
+
+    bootRestoreMs = millis();
+    Serial.printf("Restore: %s boot (reset reason %d), state %s, outputs restored at %lums\n",
+        warmBoot ? "warm" : "cold", (int)resetReason, stateLoaded ? "loaded" : "defaults", bootRestoreMs);
+    if (staleReadings) {
+        Serial.printf("Restore: CO2 %d ppm (%lds old), HTU21D %.1f C %.1f %%RH (%lds old)\n",
+            co2ppm, snapshotAgeSec(rtcSnapshot.co2At), htuTemp, htuHumidity, snapshotAgeSec(rtcSnapshot.htuAt));
+    }
 
     // CO2 sensor (UART on GPIO20 RX, GPIO21 TX)
     Serial1.begin(9600, SERIAL_8N1, 20, 21);
@@ -579,6 +1522,7 @@ void setup() {
     }
 
     // OLED
+    u8g2.setBusClock(I2C_BUS_CLOCK);
     u8g2.begin();
 
     // HTU21D (shares I2C bus with OLED on GPIO5/6, already initialized by u8g2)
@@ -587,6 +1531,7 @@ void setup() {
     } else {
         Serial.printf("HTU21D: %.1f C  %.1f %%RH\n", htu.readTemperature(), htu.readHumidity());
     }
+    Wire.setClock(I2C_BUS_CLOCK);
     u8g2.clearBuffer();
     u8g2.setFont(u8g2_font_6x10_tr);
     u8g2.drawStr(0, 10, "Connecting");
@@ -614,6 +1559,7 @@ void setup() {
         u8g2.drawStr(0, 10, "WiFi FAIL");
         u8g2.drawStr(0, 22, "Check serial");
         u8g2.sendBuffer();
+        if (otaPendingVerify) otaRejectImage("no WiFi");
         while (true) delay(1000);
     }
 
@@ -639,6 +1585,9 @@ void setup() {
     Serial.printf("Channel: %d\n", WiFi.channel());
     Serial.printf("BSSID: %s\n", WiFi.BSSIDstr().c_str());
 
+    // Tracer overhead, reported in /trace
+    measureTraceOverhead();
+
     // Initial battery reading
     readBattery();
 
@@ -656,10 +1605,19 @@ void setup() {
     server.on("/relay", handleRelay);
     server.on("/relaystatus", handleRelayStatus);
     server.on("/poll", handlePoll);
+    server.on("/trace", handleTrace);
+    server.on("/i2c", handleI2C);
+    server.on("/bootinfo", handleBootInfo);
+    server.on("/rooms", handleRooms);
     server.begin();
 
     Serial.println("Web server started.");
 
+    otaUpload.heapUsed = otaHeapUsed;
+    otaServer.begin();
+
+    roomsBegin();
+
     // Boot notification
     {
         HTTPClient http;
@@ -678,13 +1636,28 @@ void setup() {
 }
 
 void loop() {
+    TRACE_SPAN_MIN("loop", 5000);  // only iterations that did real work
     unsigned long loopStart = millis();
     static unsigned long lastLoopWarn = 0;
-    server.handleClient();
+    serviceClient();
+    i2cService();
+    otaService();
+    otaCheckHealthy();
+
+    // Multi-room state exchange (non-blocking UDP)
+    roomsService();
 
-    // Update LED strip (needed for animations like rainbow)
+    // Update LED strip (needed for animations like rainbow, and for dithering dim levels)
     if (stripOn && stripMode == "rainbow") {
+        TRACE_SPAN("loop: strip");
         updateStrip();
+    } else if (stripOn && stripDithering && millis() - lastStripFrame >= STRIP_DITHER_INTERVAL) {
+        ditherStrip();
+    }
+
+    // Coalesced NVS write of actuator state
+    if (stateDirty && millis() - stateChangedAt >= STATE_SAVE_DELAY) {
+        saveState();
     }
 
     // Non-blocking CO2 state machine
@@ -693,6 +1666,7 @@ void loop() {
         Serial1.flush();
         co2CmdSent = millis();
         co2State = CO2_WAITING;
+        traceInstant("co2: IDLE -> WAITING");
     } else if (co2State == CO2_WAITING) {
         if (Serial1.available() >= 9) {
             byte resp[9];
@@ -706,14 +1680,18 @@ void loop() {
                     co2ppm = resp[2] * 256 + resp[3];
                     co2temp = resp[4] - 40;
                     co2error = RESULT_OK;
+                    traceInstant("co2: response OK");
+                    saveSnapshot(SNAP_CO2);
                     Serial.printf("CO2: %d ppm  Temp: %d C\n", co2ppm, co2temp);
                 } else {
                     co2error = RESULT_CRC;
+                    traceInstant("co2: CRC error");
                     Serial.printf("CO2: CRC error (got 0x%02X, expected 0x%02X)\n", resp[8], crc);
                 }
             } else {
                 // Header mismatch — desync
                 co2error = RESULT_MATCH;
+                traceInstant("co2: desync");
                 Serial.printf("CO2: header mismatch (0x%02X 0x%02X)\n", resp[0], resp[1]);
                 while (Serial1.available()) Serial1.read();
                 lastCO2Read = millis() + 1000; // extra recovery delay
@@ -722,10 +1700,12 @@ void loop() {
                 lastCO2Read = millis();
             }
             co2State = CO2_IDLE;
+            traceInstant("co2: WAITING -> IDLE");
             updateOled();
         } else if (millis() - co2CmdSent > 500) {
             // Timeout
             co2error = RESULT_TIMEOUT;
+            traceInstant("co2: timeout");
             Serial.println("CO2: read timeout");
             while (Serial1.available()) Serial1.read();
             lastCO2Read = millis() + 1000; // extra recovery delay
@@ -733,24 +1713,26 @@ void loop() {
         }
     }
 
-    server.handleClient();
+    serviceClient();
+    i2cService();
 
     // Read HTU21D periodically
     if (millis() - lastHTU21DRead >= HTU21D_READ_INTERVAL) {
+        TRACE_SPAN("loop: htu21d");
         lastHTU21DRead = millis();
         readHTU21D();
-        server.handleClient();
     }
 
     // Read battery voltage periodically
     if (millis() - lastBatteryRead >= BATTERY_READ_INTERVAL) {
+        TRACE_SPAN("loop: battery");
         lastBatteryRead = millis();
         readBattery();
         updateOled();
-        server.handleClient();
+        serviceClient();
 
         // Send ntfy alert if battery is low
-        if (batteryVoltage > 1.0 && batteryVoltage < BATTERY_LOW_THRESHOLD
+        if (!otaActive && batteryVoltage > 1.0 && batteryVoltage < BATTERY_LOW_THRESHOLD
             && (ntfyFirstAlert || millis() - lastNtfySent >= NTFY_INTERVAL)) {
             ntfyFirstAlert = false;
             sendNtfyAlert();
@@ -761,6 +1743,7 @@ void loop() {
     String ip = WiFi.localIP().toString();
     int ipWidth = ip.length() * 6;
     if (ipWidth > 72 && millis() - lastScrollTime > 300) {
+        TRACE_SPAN("loop: scroll");
         lastScrollTime = millis();
         int gap = 30;
         int totalWidth = ipWidth + gap;
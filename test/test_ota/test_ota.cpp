@@ -0,0 +1,430 @@
+// Streams firmware images into OtaHttpUpload over 127.0.0.1 through a proxy
+// that throttles the upload and drops segments. A dropped segment is held
+// back for a retransmit timeout, which is what a lost TCP segment looks like
+// to the receiving application. Flash is an in-memory sink. Reports
+// throughput and peak heap use.
+//
+//   pio test -e native -f test_ota -v    (-v shows throughput and heap)
+
+#include <unity.h>
+#include <OtaUpdate.h>
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define IMAGE_SIZE (192 * 1024)
+#define FLASH_SIZE (256 * 1024)
+#define PROXY_SEGMENT 1460
+#define PROXY_RATE 256       // bytes per ms, ~2 Mbit/s
+#define PROXY_LOSS 3         // percent of segments dropped
+#define PROXY_RTO 20         // ms before a dropped segment is resent
+#define UPLOAD_TIMEOUT 20000 // ms
+
+// Static, so the image doesn't show up as heap use
+static uint8_t flashMem[FLASH_SIZE];
+
+class MemoryFlash : public OtaFlashSink {
+public:
+    bool begin(uint32_t size) override {
+        begun = true;
+        committed = aborted = false;
+        written = maxWrite = 0;
+        return size <= FLASH_SIZE;
+    }
+    bool write(const uint8_t *data, size_t len) override {
+        memcpy(flashMem + written, data, len);
+        written += len;
+        if (len > maxWrite) maxWrite = len;
+        return true;
+    }
+    bool commit() override { return committed = true; }
+    void abort() override { aborted = true; }
+
+    bool begun = false, committed = false, aborted = false;
+    size_t written = 0, maxWrite = 0;
+};
+
+class SocketStream : public OtaStream {
+public:
+    int read(uint8_t *buf, size_t size) override {
+        ssize_t n = recv(fd, buf, size, 0);
+        if (n > 0) return n;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+    void write(const char *data, size_t len) override {
+        send(fd, data, len, MSG_NOSIGNAL);
+    }
+    void close() override {
+        ::close(fd);
+        fd = -1;
+    }
+
+    int fd = -1;
+};
+
+// Request and close from a script instead of a socket, with a fake clock
+class ScriptStream : public OtaStream {
+public:
+    int read(uint8_t *buf, size_t size) override {
+        if (pos == input.size()) return hangUp ? -1 : 0;
+        size_t n = input.size() - pos < size ? input.size() - pos : size;
+        memcpy(buf, input.data() + pos, n);
+        pos += n;
+        return n;
+    }
+    void write(const char *data, size_t len) override { output.append(data, len); }
+    void close() override { closed = true; }
+
+    std::string input, output;
+    size_t pos = 0;
+    bool hangUp = false, closed = false;
+};
+
+static size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+    return mallinfo().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static double nowMs() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int listenLoopback(uint16_t &port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || bind(fd, (sockaddr *)&addr, len) < 0 || listen(fd, 1) < 0
+        || getsockname(fd, (sockaddr *)&addr, &len) < 0) {
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static int connectLoopback(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) return -1;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static int acceptWait(int listener) {
+    for (int i = 0; i < 1000; i++) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            return fd;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+// Forwards client -> device one segment at a time at PROXY_RATE, holding a
+// dropped segment back for PROXY_RTO, and stops after cutAfter bytes (0 =
+// never) as if the client had gone away. Device -> client is unimpaired.
+struct LossyProxy {
+    void pump(double now) {
+        if (pending.empty() && !clientDone) {
+            uint8_t buf[PROXY_SEGMENT];
+            ssize_t n = recv(client, buf, sizeof(buf), 0);
+            if (n > 0) {
+                pending.assign(buf, buf + n);
+                if (nextSendAt < now) nextSendAt = now;
+                if (rand() % 100 < (int)lossPercent) {
+                    drops++;
+                    nextSendAt += PROXY_RTO;
+                }
+            } else if (n == 0) {
+                clientDone = true;
+            }
+        }
+        if (!pending.empty() && now >= nextSendAt && !deviceClosed) {
+            size_t len = pending.size();
+            if (cutAfter && forwarded + len > cutAfter) len = cutAfter - forwarded;
+            ssize_t sent = len ? send(device, pending.data(), len, MSG_NOSIGNAL) : 0;
+            if (sent > 0) {
+                pending.erase(pending.begin(), pending.begin() + sent);
+                forwarded += sent;
+                nextSendAt += (double)sent / PROXY_RATE;
+            }
+            if (cutAfter && forwarded >= cutAfter) {
+                pending.clear();
+                clientDone = true;
+            }
+        }
+        if (pending.empty() && clientDone && !deviceClosed) {
+            shutdown(device, SHUT_WR);
+            deviceClosed = true;
+        }
+
+        uint8_t buf[512];
+        ssize_t n = recv(device, buf, sizeof(buf), 0);
+        if (n > 0) {
+            send(client, buf, n, MSG_NOSIGNAL);
+        } else if (n == 0 && !responseDone) {
+            shutdown(client, SHUT_WR);
+            responseDone = true;
+        }
+    }
+
+    int client = -1, device = -1;
+    unsigned lossPercent = 0;
+    size_t cutAfter = 0;
+    std::vector<uint8_t> pending;
+    double nextSendAt = 0;
+    size_t forwarded = 0;
+    unsigned drops = 0;
+    bool clientDone = false, deviceClosed = false, responseDone = false;
+};
+
+struct UploadResult {
+    int status = 0;
+    std::string body;
+    double ms = 0;
+    unsigned drops = 0;
+    unsigned serviceCalls = 0;
+    size_t peakHeap = 0;  // above what was in use before the upload
+};
+
+MemoryFlash flash;
+OtaHttpUpload upload(flash);
+std::vector<uint8_t> image;
+
+static std::string shaHex(const uint8_t *data, size_t len) {
+    OtaSha256 sha;
+    uint8_t digest[32];
+    sha.begin();
+    sha.update(data, len);
+    sha.finish(digest);
+    char hex[65];
+    for (int i = 0; i < 32; i++) snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    return hex;
+}
+
+// Client -> proxy -> device, all non-blocking and pumped from this one loop,
+// the device side one OtaHttpUpload::service() per pass as in loop().
+static UploadResult runUpload(const std::string &sha, unsigned lossPercent, size_t cutAfter) {
+    UploadResult result;
+    uint16_t devicePort, proxyPort;
+    int deviceListener = listenLoopback(devicePort);
+    int proxyListener = listenLoopback(proxyPort);
+    if (deviceListener < 0 || proxyListener < 0) TEST_IGNORE_MESSAGE("no TCP on loopback");
+
+    int client = connectLoopback(proxyPort);
+    LossyProxy proxy;
+    proxy.client = acceptWait(proxyListener);
+    proxy.device = connectLoopback(devicePort);
+    proxy.lossPercent = lossPercent;
+    proxy.cutAfter = cutAfter;
+    SocketStream stream;
+    stream.fd = acceptWait(deviceListener);
+    TEST_ASSERT_TRUE(client >= 0 && proxy.client >= 0 && proxy.device >= 0 && stream.fd >= 0);
+
+    char header[256];
+    snprintf(header, sizeof(header),
+        "POST /update?sha256=%s HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Type: application/octet-stream\r\n"
+        "Content-Length: %u\r\n\r\n", sha.c_str(), (unsigned)image.size());
+    std::string request = header;
+    request.append(image.begin(), image.end());
+    size_t requestSent = 0;
+    std::string response;
+
+    upload.heapUsed = heapInUse;
+    double start = nowMs();
+    size_t baseline = heapInUse();
+    upload.start(stream, (uint32_t)start);
+    bool clientDone = false;
+    while (!clientDone && nowMs() - start < UPLOAD_TIMEOUT) {
+        double now = nowMs();
+        if (requestSent < request.size()) {
+            ssize_t n = send(client, request.data() + requestSent, request.size() - requestSent, MSG_NOSIGNAL);
+            if (n > 0) requestSent += n;
+        }
+        proxy.pump(now);
+        if (upload.busy()) {
+            upload.service((uint32_t)now);
+            result.serviceCalls++;
+        }
+        char buf[512];
+        ssize_t n = recv(client, buf, sizeof(buf), 0);
+        if (n > 0) response.append(buf, n);
+        if (n == 0) clientDone = true;
+        usleep(50);
+    }
+    result.ms = nowMs() - start;
+    result.drops = proxy.drops;
+    result.peakHeap = upload.peakHeapUsed > baseline ? upload.peakHeapUsed - baseline : 0;
+    sscanf(response.c_str(), "HTTP/1.1 %d", &result.status);
+    size_t bodyAt = response.find("\r\n\r\n");
+    if (bodyAt != std::string::npos) result.body = response.substr(bodyAt + 4);
+
+    close(client);
+    close(proxy.client);
+    close(proxy.device);
+    if (stream.fd >= 0) close(stream.fd);
+    close(deviceListener);
+    close(proxyListener);
+    return result;
+}
+
+static void runScript(ScriptStream &script, uint32_t idleFor) {
+    uint32_t now = 1000;
+    upload.heapUsed = nullptr;
+    upload.start(script, now);
+    for (int i = 0; i < 1000 && upload.service(now); i++) {
+        if (script.pos == script.input.size()) now += idleFor;
+    }
+}
+
+void setUp() {
+    flash = MemoryFlash();
+    if (image.empty()) {
+        uint32_t x = 12345;
+        for (int i = 0; i < IMAGE_SIZE; i++) {
+            x = x * 1103515245 + 12345;
+            image.push_back(x >> 16);
+        }
+    }
+    srand(1);
+}
+
+void tearDown() {}
+
+void test_sha256_vectors() {
+    TEST_ASSERT_EQUAL_STRING("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+        shaHex(nullptr, 0).c_str());
+    TEST_ASSERT_EQUAL_STRING("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+        shaHex((const uint8_t *)"abc", 3).c_str());
+    const char *twoBlocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    TEST_ASSERT_EQUAL_STRING("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+        shaHex((const uint8_t *)twoBlocks, strlen(twoBlocks)).c_str());
+
+    // One million 'a' in uneven pieces, so the block buffer is split every way
+    std::vector<uint8_t> a(1000000, 'a');
+    OtaSha256 sha;
+    uint8_t digest[32];
+    char hex[65];
+    sha.begin();
+    for (size_t pos = 0, step = 1; pos < a.size(); pos += step, step = step % 131 + 7) {
+        sha.update(a.data() + pos, pos + step < a.size() ? step : a.size() - pos);
+    }
+    sha.finish(digest);
+    for (int i = 0; i < 32; i++) snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    TEST_ASSERT_EQUAL_STRING("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", hex);
+}
+
+void test_matching_digest_is_committed() {
+    UploadResult r = runUpload(shaHex(image.data(), image.size()), PROXY_LOSS, 0);
+    TEST_ASSERT_EQUAL(200, r.status);
+    TEST_ASSERT_TRUE(upload.succeeded());
+    TEST_ASSERT_TRUE(flash.committed);
+    TEST_ASSERT_FALSE(flash.aborted);
+    TEST_ASSERT_EQUAL(IMAGE_SIZE, flash.written);
+    TEST_ASSERT_TRUE(memcmp(flashMem, image.data(), IMAGE_SIZE) == 0);
+    TEST_ASSERT_TRUE(r.body.find("\"ok\":1") != std::string::npos);
+
+    // Never more than a chunk per call, so loop() keeps running during the upload
+    TEST_ASSERT_LESS_OR_EQUAL(OTA_CHUNK, flash.maxWrite);
+    TEST_ASSERT_GREATER_OR_EQUAL(IMAGE_SIZE / OTA_CHUNK, r.serviceCalls);
+
+    char msg[192];
+    snprintf(msg, sizeof(msg),
+        "%d bytes in %.0f ms (%.0f kbit/s) at %d kbit/s, %u of %d segments dropped; "
+        "%u service() calls; peak heap %u bytes above baseline",
+        IMAGE_SIZE, r.ms, IMAGE_SIZE * 8 / r.ms, PROXY_RATE * 8, r.drops, IMAGE_SIZE / PROXY_SEGMENT + 1,
+        r.serviceCalls, (unsigned)r.peakHeap);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_GREATER_OR_EQUAL(1, r.drops);
+    TEST_ASSERT_LESS_OR_EQUAL(4096, r.peakHeap);  // nothing buffered per image
+}
+
+void test_mismatched_digest_is_rejected() {
+    UploadResult r = runUpload(shaHex(image.data(), image.size() - 1), PROXY_LOSS, 0);
+    TEST_ASSERT_EQUAL(400, r.status);
+    TEST_ASSERT_FALSE(upload.succeeded());
+    TEST_ASSERT_FALSE(flash.committed);
+    TEST_ASSERT_TRUE(flash.aborted);
+    TEST_ASSERT_TRUE(r.body.find("sha256 mismatch") != std::string::npos);
+}
+
+void test_truncated_upload_is_rejected() {
+    UploadResult r = runUpload(shaHex(image.data(), image.size()), PROXY_LOSS, IMAGE_SIZE / 2);
+    TEST_ASSERT_FALSE(upload.succeeded());
+    TEST_ASSERT_FALSE(flash.committed);
+    TEST_ASSERT_TRUE(flash.aborted);
+    TEST_ASSERT_TRUE(flash.written < IMAGE_SIZE);
+    TEST_ASSERT_EQUAL(400, r.status);
+    TEST_ASSERT_TRUE(r.body.find("upload truncated") != std::string::npos);
+}
+
+void test_stalled_upload_times_out() {
+    ScriptStream script;
+    script.input = "POST /update?sha256=" + shaHex(image.data(), image.size())
+        + " HTTP/1.1\r\nContent-Length: " + std::to_string(image.size()) + "\r\n\r\n";
+    script.input.append(image.begin(), image.begin() + 4000);
+    runScript(script, OTA_IDLE_TIMEOUT / 4);
+    TEST_ASSERT_TRUE(script.closed);
+    TEST_ASSERT_FALSE(flash.committed);
+    TEST_ASSERT_TRUE(flash.aborted);
+    TEST_ASSERT_EQUAL(4000, flash.written);
+    TEST_ASSERT_TRUE(script.output.rfind("HTTP/1.1 408", 0) == 0);
+}
+
+void test_bad_requests_never_touch_flash() {
+    const char *requests[] = {
+        "POST /update HTTP/1.1\r\nContent-Length: 10\r\n\r\n",
+        "POST /update?sha256=xyz HTTP/1.1\r\nContent-Length: 10\r\n\r\n",
+        "GET /update HTTP/1.1\r\n\r\n",
+        "POST /update?sha256=e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855 HTTP/1.1\r\n\r\n",
+        "POST /other HTTP/1.1\r\nContent-Length: 10\r\n\r\n",
+        "POST /upd",
+    };
+    const char *status[] = {"400", "400", "405", "411", "404", "400"};
+    for (int i = 0; i < 6; i++) {
+        ScriptStream script;
+        script.input = requests[i];
+        script.hangUp = true;
+        runScript(script, 0);
+        TEST_ASSERT_TRUE(script.closed);
+        TEST_ASSERT_FALSE(flash.begun);
+        TEST_ASSERT_EQUAL_STRING_LEN(status[i], script.output.c_str() + 9, 3);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_sha256_vectors);
+    RUN_TEST(test_matching_digest_is_committed);
+    RUN_TEST(test_mismatched_digest_is_rejected);
+    RUN_TEST(test_truncated_upload_is_rejected);
+    RUN_TEST(test_stalled_upload_times_out);
+    RUN_TEST(test_bad_requests_never_touch_flash);
+    return UNITY_END();
+}
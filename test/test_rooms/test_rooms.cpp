@@ -0,0 +1,264 @@
+// Runs several RoomNodes in one process, each with its own multicast socket
+// on 127.0.0.1, and drives them with a fake clock: election, hub failover,
+// expiry, name sanitising and reading validity.
+//
+//   pio test -e native -f test_rooms
+
+#include <unity.h>
+#include <RoomHub.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define TEST_GROUP "239.255.42.99"
+#define TEST_PORT 42100
+#define TEST_STEP 500  // ms of fake time per round
+
+class LoopbackRoomSocket : public RoomSocket {
+public:
+    bool open() {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) return false;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(TEST_PORT);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0) return false;
+        ip_mreq mreq = {};
+        mreq.imr_multiaddr.s_addr = inet_addr(TEST_GROUP);
+        mreq.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) return false;
+        in_addr iface = {};
+        iface.s_addr = htonl(INADDR_LOOPBACK);
+        if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0) return false;
+        unsigned char loop = 1;
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        return fcntl(fd, F_SETFL, O_NONBLOCK) == 0;
+    }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    int receive(uint8_t *buf, size_t size, uint32_t &fromIp) override {
+        uint8_t packet[512];
+        sockaddr_in from = {};
+        socklen_t fromLen = sizeof(from);
+        ssize_t len = recvfrom(fd, packet, sizeof(packet), 0, (sockaddr *)&from, &fromLen);
+        if (len <= 0) return 0;
+        memcpy(buf, packet, (size_t)len < size ? len : size);
+        fromIp = from.sin_addr.s_addr;
+        return len;
+    }
+
+    bool send(const uint8_t *buf, size_t len) override {
+        sockaddr_in group = {};
+        group.sin_family = AF_INET;
+        group.sin_port = htons(TEST_PORT);
+        group.sin_addr.s_addr = inet_addr(TEST_GROUP);
+        return sendto(fd, buf, len, 0, (sockaddr *)&group, sizeof(group)) == (ssize_t)len;
+    }
+
+    int fd = -1;
+};
+
+struct TestNode {
+    LoopbackRoomSocket socket;
+    RoomNode node{socket};
+    RoomPacket state = {};
+    bool alive = true;  // false = not serviced, as if powered off
+};
+
+#define NODE_COUNT 4
+TestNode nodes[NODE_COUNT];
+uint32_t now;
+
+// Node IDs are chosen so the candidates aren't in slot order: hub is node 2
+// (ID 0x10), failover goes to node 0 (ID 0x20).
+const uint32_t NODE_IDS[NODE_COUNT] = {0x20, 0x30, 0x10, 0x05};
+const bool NODE_CANDIDATE[NODE_COUNT] = {true, false, true, false};
+
+void runFor(uint32_t ms) {
+    for (uint32_t end = now + ms; now < end; now += TEST_STEP) {
+        for (TestNode &n : nodes) {
+            if (n.alive) n.node.service(now, n.state, htonl(INADDR_LOOPBACK));
+        }
+        usleep(1000);  // let loopback deliver
+    }
+}
+
+const RoomEntry *findRoom(const RoomNode &node, uint32_t nodeId) {
+    for (const RoomEntry &r : node.rooms) {
+        if (r.used && r.state.nodeId == nodeId) return &r;
+    }
+    return nullptr;
+}
+
+int roomCount(const RoomNode &node) {
+    int count = 0;
+    for (const RoomEntry &r : node.rooms) count += r.used;
+    return count;
+}
+
+uint32_t hubId(const RoomNode &node) {
+    const RoomEntry *hub = node.hub(now);
+    return hub ? hub->state.nodeId : 0;
+}
+
+void setUp() {
+    now = 1000;
+    for (int i = 0; i < NODE_COUNT; i++) {
+        TestNode &n = nodes[i];
+        if (!n.socket.open()) TEST_IGNORE_MESSAGE("no multicast on loopback");
+        char name[16];
+        snprintf(name, sizeof(name), "node-%d", i);
+        n.node.begin(NODE_IDS[i], name, NODE_CANDIDATE[i]);
+        n.state = RoomPacket();
+        n.alive = true;
+    }
+}
+
+void tearDown() {
+    for (TestNode &n : nodes) n.socket.close();
+}
+
+void test_all_nodes_agree_on_hub() {
+    runFor(2000);
+    for (TestNode &n : nodes) {
+        TEST_ASSERT_EQUAL(NODE_COUNT, roomCount(n.node));
+        TEST_ASSERT_EQUAL_HEX32(0x10, hubId(n.node));
+    }
+    TEST_ASSERT_TRUE(nodes[2].node.isHub(now));
+    TEST_ASSERT_FALSE(nodes[0].node.isHub(now));
+}
+
+void test_hub_failover() {
+    runFor(2000);
+    nodes[2].alive = false;
+
+    // Still hub while it could just be between heartbeats
+    runFor(ROOM_HUB_HEARTBEAT);
+    TEST_ASSERT_EQUAL_HEX32(0x10, hubId(nodes[1].node));
+
+    // Gone after ROOM_HUB_TIMEOUT, long before the room itself expires
+    runFor(ROOM_HUB_TIMEOUT - ROOM_HUB_HEARTBEAT + TEST_STEP);
+    for (int i = 0; i < NODE_COUNT; i++) {
+        if (i == 2) continue;
+        TEST_ASSERT_EQUAL_HEX32(0x20, hubId(nodes[i].node));
+        TEST_ASSERT_NOT_NULL(findRoom(nodes[i].node, 0x10));
+    }
+    TEST_ASSERT_TRUE(nodes[0].node.isHub(now));
+
+    runFor(ROOM_TIMEOUT);
+    TEST_ASSERT_NULL(findRoom(nodes[1].node, 0x10));
+    TEST_ASSERT_EQUAL(NODE_COUNT - 1, roomCount(nodes[1].node));
+
+    // The old hub comes back and takes over again
+    nodes[2].alive = true;
+    runFor(2000);
+    TEST_ASSERT_EQUAL_HEX32(0x10, hubId(nodes[1].node));
+}
+
+void test_no_candidates_no_hub() {
+    nodes[0].alive = false;
+    nodes[2].alive = false;
+    runFor(2000);
+    TEST_ASSERT_NULL(nodes[1].node.hub(now));
+    TEST_ASSERT_EQUAL(2, roomCount(nodes[1].node));
+}
+
+void test_changes_sent_without_waiting_for_heartbeat() {
+    runFor(2000);
+    nodes[1].state.co2ppm = 800;
+    nodes[1].state.flags |= ROOM_FLAG_CO2_VALID;
+    runFor(ROOM_MIN_INTERVAL + TEST_STEP);
+    const RoomEntry *r = findRoom(nodes[3].node, 0x30);
+    TEST_ASSERT_NOT_NULL(r);
+    TEST_ASSERT_EQUAL(800, r->state.co2ppm);
+    TEST_ASSERT_TRUE(r->state.flags & ROOM_FLAG_CO2_VALID);
+
+    // Below the noise threshold: not sent until the heartbeat
+    nodes[1].state.co2ppm = 805;
+    runFor(ROOM_MIN_INTERVAL + TEST_STEP);
+    TEST_ASSERT_EQUAL(800, findRoom(nodes[3].node, 0x30)->state.co2ppm);
+    runFor(ROOM_HEARTBEAT);
+    TEST_ASSERT_EQUAL(805, findRoom(nodes[3].node, 0x30)->state.co2ppm);
+}
+
+void test_state_changed_thresholds() {
+    RoomPacket a = {}, b = {};
+    TEST_ASSERT_FALSE(roomStateChanged(a, b));
+    b.co2ppm = 9;
+    TEST_ASSERT_FALSE(roomStateChanged(a, b));
+    b.co2ppm = 10;
+    TEST_ASSERT_TRUE(roomStateChanged(a, b));
+    b = a;
+    b.temp10 = -2;
+    TEST_ASSERT_TRUE(roomStateChanged(a, b));
+    b = a;
+    b.flags = ROOM_FLAG_HTU_STALE;
+    TEST_ASSERT_TRUE(roomStateChanged(a, b));
+}
+
+void test_hostile_name_and_bad_packets() {
+    runFor(1000);
+    RoomPacket p = {};
+    p.magic[0] = 'R';
+    p.magic[1] = 'C';
+    p.version = ROOM_PACKET_VERSION;
+    p.nodeId = 0x99;
+    memcpy(p.name, "a\"b\\c\n\x01\xff", 9);
+    nodes[3].socket.send((const uint8_t *)&p, sizeof(p));
+    nodes[3].socket.send((const uint8_t *)&p, sizeof(p) - 1);  // short
+    p.nodeId = 0x98;
+    p.version = ROOM_PACKET_VERSION + 1;
+    nodes[3].socket.send((const uint8_t *)&p, sizeof(p));      // other version
+    runFor(TEST_STEP);
+
+    const RoomEntry *r = findRoom(nodes[1].node, 0x99);
+    TEST_ASSERT_NOT_NULL(r);
+    TEST_ASSERT_EQUAL_STRING_LEN("a_b_c___", r->state.name, 9);
+    TEST_ASSERT_NULL(findRoom(nodes[1].node, 0x98));
+}
+
+void test_history_skips_rooms_without_readings() {
+    // Node 1 has only read the HTU21D, node 2 only the MH-Z19
+    nodes[1].state.flags = ROOM_FLAG_HTU_VALID | ROOM_FLAG_HTU_STALE;
+    nodes[1].state.temp10 = 215;
+    nodes[2].state.flags = ROOM_FLAG_CO2_VALID | ROOM_FLAG_CANDIDATE;
+    nodes[2].state.co2ppm = 640;
+    runFor(ROOM_HISTORY_INTERVAL + 2000);
+
+    const RoomEntry *htuOnly = findRoom(nodes[0].node, 0x30);
+    TEST_ASSERT_EQUAL(1, htuOnly->historyCount);
+    TEST_ASSERT_EQUAL(215, htuOnly->history[0].temp10);
+    TEST_ASSERT_EQUAL(ROOM_FLAG_HTU_VALID, htuOnly->history[0].flags);
+
+    const RoomEntry *co2Only = findRoom(nodes[0].node, 0x10);
+    TEST_ASSERT_EQUAL(1, co2Only->historyCount);
+    TEST_ASSERT_EQUAL(640, co2Only->history[0].co2ppm);
+    TEST_ASSERT_EQUAL(ROOM_FLAG_CO2_VALID, co2Only->history[0].flags);
+
+    TEST_ASSERT_EQUAL(0, findRoom(nodes[0].node, 0x05)->historyCount);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_all_nodes_agree_on_hub);
+    RUN_TEST(test_hub_failover);
+    RUN_TEST(test_no_candidates_no_hub);
+    RUN_TEST(test_changes_sent_without_waiting_for_heartbeat);
+    RUN_TEST(test_state_changed_thresholds);
+    RUN_TEST(test_hostile_name_and_bad_packets);
+    RUN_TEST(test_history_skips_rooms_without_readings);
+    return UNITY_END();
+}
@@ -0,0 +1,195 @@
+// Checks the LED strip pipeline against the floating point maths it stands
+// in for, and times it against the FastLED-style scale8 path it replaced.
+//
+//   pio test -e native -f test_strip -v    (-v shows the benchmark numbers)
+
+#include <unity.h>
+#include <StripPipeline.h>
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+
+#define NUM_LEDS 30
+#define DITHER_FRAMES 256
+
+struct Rgb {
+    uint8_t raw[3];
+    uint8_t &operator[](int ch) { return raw[ch]; }
+    const uint8_t &operator[](int ch) const { return raw[ch]; }
+};
+
+// What the pipeline approximates, in output levels (0-255, fractional).
+double referenceLevel(uint8_t value, int preset, uint8_t brightness, int ch) {
+    const uint8_t temp[3] = {COLOR_TEMPS[preset].r, COLOR_TEMPS[preset].g, COLOR_TEMPS[preset].b};
+    double l = brightness * 100.0 / 255;
+    double y = l <= 8 ? l / 903.3 : pow((l + 16) / 116, 3);
+    return 255 * pow(value / 255.0, STRIP_GAMMA) * LED_CORRECTION[ch] * temp[ch] / (255.0 * 255) * y;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_gamma_lut_matches_libm() {
+    for (int i = 0; i < 256; i++) {
+        double expected = pow(i / 255.0, STRIP_GAMMA) * (255 << 8);
+        TEST_ASSERT_FLOAT_WITHIN(0.5001, expected, GAMMA_LUT[i]);
+    }
+}
+
+void test_brightness_lut_matches_cie() {
+    for (int i = 0; i < 256; i++) {
+        double l = i * 100.0 / 255;
+        double y = l <= 8 ? l / 903.3 : pow((l + 16) / 116, 3);
+        TEST_ASSERT_FLOAT_WITHIN(0.5001, y * 65535, BRIGHTNESS_LUT[i]);
+    }
+}
+
+void test_channel_scales() {
+    for (int p = 0; p < NUM_COLOR_TEMPS; p++) {
+        const uint8_t temp[3] = {COLOR_TEMPS[p].r, COLOR_TEMPS[p].g, COLOR_TEMPS[p].b};
+        for (int ch = 0; ch < 3; ch++) {
+            double expected = LED_CORRECTION[ch] * temp[ch] / (255.0 * 255) * 65535;
+            TEST_ASSERT_FLOAT_WITHIN(1.0, expected, CHANNEL_SCALES[p][ch]);
+        }
+    }
+    // Neutral is the LED correction alone
+    TEST_ASSERT_EQUAL(65535, CHANNEL_SCALES[0][0]);
+    TEST_ASSERT_EQUAL(65535 * 176 / 255, CHANNEL_SCALES[0][1]);
+}
+
+// Averaged over enough frames, the dithered 8-bit output should land on the
+// fractional reference level for every preset, slider position and colour.
+void test_dithered_average_matches_reference() {
+    double worst = 0;
+    for (int p = 0; p < NUM_COLOR_TEMPS; p++) {
+        for (int bri = 2; bri < 256; bri += 11) {
+            for (int v = 0; v < 256; v += 17) {
+                Rgb src[NUM_LEDS], dst[NUM_LEDS];
+                uint8_t residue[NUM_LEDS][3];
+                stripSeedResidue(residue);
+                for (Rgb &px : src) px = {{(uint8_t)v, (uint8_t)(255 - v), (uint8_t)(v / 2)}};
+                uint32_t mult[3];
+                stripMultipliers(p, bri, mult);
+                double sum[3] = {};
+                for (int f = 0; f < DITHER_FRAMES; f++) {
+                    renderStrip(src, dst, mult, residue);
+                    for (int ch = 0; ch < 3; ch++) sum[ch] += dst[0][ch];
+                }
+                for (int ch = 0; ch < 3; ch++) {
+                    double err = fabs(sum[ch] / DITHER_FRAMES - referenceLevel(src[0][ch], p, bri, ch));
+                    if (err > worst) worst = err;
+                }
+            }
+        }
+    }
+    char msg[64];
+    snprintf(msg, sizeof(msg), "worst average error %.4f levels", worst);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_OR_EQUAL(0.05, worst);
+}
+
+void test_dither_only_reported_for_fractional_low_levels() {
+    Rgb src[NUM_LEDS], dst[NUM_LEDS];
+    uint8_t residue[NUM_LEDS][3] = {};
+    uint32_t mult[3];
+
+    for (Rgb &px : src) px = {{0, 0, 0}};
+    stripMultipliers(0, 255, mult);
+    TEST_ASSERT_FALSE(renderStrip(src, dst, mult, residue));
+
+    // White at slider 20: R is ~2.2 levels, a visible step
+    for (Rgb &px : src) px = {{255, 255, 255}};
+    stripMultipliers(0, 20, mult);
+    TEST_ASSERT_TRUE(renderStrip(src, dst, mult, residue));
+
+    // White at slider 128: R is ~47.4 levels, one step is invisible, no refresh needed
+    stripMultipliers(0, 128, mult);
+    TEST_ASSERT_FALSE(renderStrip(src, dst, mult, residue));
+}
+
+// A solid dim colour: on every frame only part of the strip should be on the
+// upper level, not all pixels together.
+void test_seeded_residue_dithers_out_of_phase() {
+    Rgb src[NUM_LEDS], dst[NUM_LEDS];
+    uint8_t residue[NUM_LEDS][3];
+    stripSeedResidue(residue);
+    uint32_t mult[3];
+    for (Rgb &px : src) px = {{255, 255, 255}};
+    stripMultipliers(0, 20, mult);
+    uint32_t level = (uint32_t)GAMMA_LUT[255] * mult[0] >> 16;
+    double fraction = (level & 0xFF) / 256.0;
+
+    for (int f = 0; f < DITHER_FRAMES; f++) {
+        renderStrip(src, dst, mult, residue);
+        int upper = 0;
+        for (const Rgb &px : dst) upper += px[0] > (level >> 8);
+        TEST_ASSERT_FLOAT_WITHIN(NUM_LEDS / 6.0, fraction * NUM_LEDS, upper);
+    }
+}
+
+// FastLED's path for the same job before the pipeline: brightness and colour
+// correction folded into one scale8() per channel, no gamma.
+static inline uint8_t scale8(uint8_t i, uint8_t scale) {
+    return ((uint16_t)i * (1 + scale)) >> 8;
+}
+
+void fastledPath(const Rgb (&src)[NUM_LEDS], Rgb (&dst)[NUM_LEDS], uint8_t brightness) {
+    uint8_t adj[3];
+    for (int ch = 0; ch < 3; ch++) adj[ch] = scale8(LED_CORRECTION[ch], brightness);
+    for (int i = 0; i < NUM_LEDS; i++) {
+        for (int ch = 0; ch < 3; ch++) dst[i][ch] = scale8(src[i][ch], adj[ch]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t ticks() { return __rdtsc(); }
+#define TICK_UNIT "cycles"
+#else
+static inline uint64_t ticks() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#define TICK_UNIT "ns"
+#endif
+
+void test_benchmark_against_fastled_path() {
+    const int frames = 200000;
+    Rgb src[NUM_LEDS], dst[NUM_LEDS];
+    uint8_t residue[NUM_LEDS][3] = {};
+    for (int i = 0; i < NUM_LEDS; i++) src[i] = {{(uint8_t)(i * 8), 200, (uint8_t)(255 - i * 8)}};
+    volatile uint32_t sink = 0;
+
+    uint64_t t0 = ticks();
+    for (int f = 0; f < frames; f++) {
+        uint32_t mult[3];
+        stripMultipliers(f % NUM_COLOR_TEMPS, f, mult);
+        renderStrip(src, dst, mult, residue);
+        sink += dst[f % NUM_LEDS][0];
+    }
+    uint64_t t1 = ticks();
+    for (int f = 0; f < frames; f++) {
+        fastledPath(src, dst, f);
+        sink += dst[f % NUM_LEDS][0];
+    }
+    uint64_t t2 = ticks();
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%d LEDs: pipeline %.0f " TICK_UNIT "/frame, FastLED-style scale8 %.0f " TICK_UNIT "/frame",
+        NUM_LEDS, (double)(t1 - t0) / frames, (double)(t2 - t1) / frames);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_TRUE(t1 > t0 && t2 > t1);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_gamma_lut_matches_libm);
+    RUN_TEST(test_brightness_lut_matches_cie);
+    RUN_TEST(test_channel_scales);
+    RUN_TEST(test_dithered_average_matches_reference);
+    RUN_TEST(test_dither_only_reported_for_fractional_low_levels);
+    RUN_TEST(test_seeded_residue_dithers_out_of_phase);
+    RUN_TEST(test_benchmark_against_fastled_path);
+    return UNITY_END();
+}